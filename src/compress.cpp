@@ -0,0 +1,252 @@
+/*==============================================================================
+
+
+    Redis for SA:MP
+
+    Copyright (C) 2016 Barnaby "Southclaws" Keene
+
+    This program is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by the
+    Free Software Foundation, either version 3 of the License, or (at your
+    option) any later version.
+
+    This program is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+    See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Note:
+    Values are stored as the magic bytes "\x89RZ", a format version byte, the
+    uncompressed length and an FNV-1a checksum of the uncompressed bytes, each
+    as four little-endian bytes, then a single LZ4 block. This is the raw
+    block format and not an LZ4 frame, other services reading these values
+    need to strip the header themselves. The compressor is the plain
+    greedy hash-table matcher from the LZ4 reference, which is plenty for the
+    JSON-ish blobs this is meant for and keeps the plugin free of another
+    library to build on both platforms.
+
+
+==============================================================================*/
+
+#include "compress.hpp"
+
+#include <cstring>
+#include <vector>
+
+namespace {
+const char MAGIC[3] = { '\x89', 'R', 'Z' };
+// 1 had no checksum, values written with it are read back as they are
+const unsigned char VERSION = 2;
+const size_t HEADER_SIZE = 12;
+const size_t MIN_MATCH = 4;
+const size_t LAST_LITERALS = 5;
+const size_t MF_LIMIT = 12;
+const int HASH_LOG = 12;
+const size_t MAX_OFFSET = 65535;
+// a block can't expand by more than this, so anything claiming more is junk
+const size_t MAX_RATIO = 255;
+const size_t MAX_UNPACKED = 64 * 1024 * 1024;
+
+unsigned int read32(const unsigned char* p)
+{
+    unsigned int v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+unsigned int hash(unsigned int v)
+{
+    return (v * 2654435761U) >> (32 - HASH_LOG);
+}
+
+unsigned int checksum(const std::string& data)
+{
+    unsigned int h = 2166136261U;
+    for (unsigned char c : data) {
+        h = (h ^ c) * 16777619U;
+    }
+    return h;
+}
+
+void write32(std::string& out, size_t v)
+{
+    for (int i = 0; i < 4; ++i) {
+        out += static_cast<char>((v >> (i * 8)) & 0xFF);
+    }
+}
+
+size_t readHeader32(const unsigned char* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<size_t>(p[3]) << 24);
+}
+
+void writeLength(std::string& out, size_t len)
+{
+    while (len >= 255) {
+        out += static_cast<char>(255);
+        len -= 255;
+    }
+    out += static_cast<char>(len);
+}
+
+void writeSequence(std::string& out, const unsigned char* literals, size_t literalLen, size_t offset, size_t matchLen)
+{
+    size_t matchCode = matchLen >= MIN_MATCH ? matchLen - MIN_MATCH : 0;
+    unsigned char token = static_cast<unsigned char>(
+        ((literalLen >= 15 ? 15 : literalLen) << 4) | (matchCode >= 15 ? 15 : matchCode));
+    out += static_cast<char>(token);
+
+    if (literalLen >= 15) {
+        writeLength(out, literalLen - 15);
+    }
+    out.append(reinterpret_cast<const char*>(literals), literalLen);
+
+    if (matchLen == 0) {
+        return;
+    }
+
+    out += static_cast<char>(offset & 0xFF);
+    out += static_cast<char>((offset >> 8) & 0xFF);
+    if (matchCode >= 15) {
+        writeLength(out, matchCode - 15);
+    }
+}
+
+bool readLength(const unsigned char*& p, const unsigned char* end, size_t& len)
+{
+    unsigned char b;
+    do {
+        if (p >= end) {
+            return false;
+        }
+        b = *p++;
+        len += b;
+    } while (b == 255);
+    return true;
+}
+}
+
+bool Compress::isPacked(const std::string& in)
+{
+    return in.length() >= HEADER_SIZE && memcmp(in.data(), MAGIC, sizeof(MAGIC)) == 0
+        && static_cast<unsigned char>(in[sizeof(MAGIC)]) == VERSION;
+}
+
+std::string Compress::pack(const std::string& in)
+{
+    const unsigned char* base = reinterpret_cast<const unsigned char*>(in.data());
+    const size_t len = in.length();
+
+    std::string out(MAGIC, sizeof(MAGIC));
+    out.reserve(HEADER_SIZE + len + len / 255 + 16);
+    out += static_cast<char>(VERSION);
+    write32(out, len);
+    write32(out, checksum(in));
+
+    size_t anchor = 0;
+    if (len >= MF_LIMIT + 1) {
+        std::vector<unsigned int> table(1 << HASH_LOG, 0);
+        const size_t matchLimit = len - LAST_LITERALS;
+        const size_t searchLimit = len - MF_LIMIT;
+        size_t pos = 1;
+
+        while (pos < searchLimit) {
+            unsigned int seq = read32(base + pos);
+            unsigned int h = hash(seq);
+            size_t candidate = table[h];
+            table[h] = static_cast<unsigned int>(pos);
+
+            if (pos - candidate > MAX_OFFSET || read32(base + candidate) != seq) {
+                ++pos;
+                continue;
+            }
+
+            size_t matchLen = MIN_MATCH;
+            while (pos + matchLen < matchLimit && base[candidate + matchLen] == base[pos + matchLen]) {
+                ++matchLen;
+            }
+
+            writeSequence(out, base + anchor, pos - anchor, pos - candidate, matchLen);
+            pos += matchLen;
+            anchor = pos;
+        }
+    }
+
+    writeSequence(out, base + anchor, len - anchor, 0, 0);
+    return out;
+}
+
+bool Compress::unpack(const std::string& in, std::string& out)
+{
+    if (!isPacked(in)) {
+        return false;
+    }
+
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(in.data());
+    const unsigned char* end = p + in.length();
+    size_t len = readHeader32(p + 4);
+    size_t sum = readHeader32(p + 8);
+    p += HEADER_SIZE;
+
+    // the length comes from whatever is stored in the key, which may be a
+    // player supplied string that happens to start with the magic bytes.
+    if (len > (in.length() - HEADER_SIZE) * MAX_RATIO || len > MAX_UNPACKED) {
+        return false;
+    }
+
+    std::string result;
+    result.reserve(len);
+
+    while (p < end) {
+        unsigned char token = *p++;
+
+        size_t literalLen = token >> 4;
+        if (literalLen == 15 && !readLength(p, end, literalLen)) {
+            return false;
+        }
+        if (static_cast<size_t>(end - p) < literalLen || result.length() + literalLen > len) {
+            return false;
+        }
+        result.append(reinterpret_cast<const char*>(p), literalLen);
+        p += literalLen;
+
+        // the last sequence has no match
+        if (p == end) {
+            break;
+        }
+
+        if (end - p < 2) {
+            return false;
+        }
+        size_t offset = p[0] | (p[1] << 8);
+        p += 2;
+
+        size_t matchLen = token & 0x0F;
+        if (matchLen == 15 && !readLength(p, end, matchLen)) {
+            return false;
+        }
+        matchLen += MIN_MATCH;
+
+        if (offset == 0 || offset > result.length() || result.length() + matchLen > len) {
+            return false;
+        }
+
+        // matches may overlap the bytes they produce, so copy one at a time
+        size_t from = result.length() - offset;
+        for (size_t i = 0; i < matchLen; ++i) {
+            result += result[from + i];
+        }
+    }
+
+    // a string that merely looks like a block is very unlikely to decode to
+    // bytes matching the checksum as well.
+    if (result.length() != len || checksum(result) != sum) {
+        return false;
+    }
+
+    out.swap(result);
+    return true;
+}
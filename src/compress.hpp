@@ -0,0 +1,40 @@
+/*==============================================================================
+
+
+    Redis for SA:MP
+
+    Copyright (C) 2016 Barnaby "Southclaws" Keene
+
+    This program is free software: you can redistribute it and/or modify it
+    under the terms of the GNU General Public License as published by the
+    Free Software Foundation, either version 3 of the License, or (at your
+    option) any later version.
+
+    This program is distributed in the hope that it will be useful, but
+    WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+    See the GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License along
+    with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+    Note:
+    A small LZ4 block format compressor used for large values. Compressed
+    values start with a magic header, a version and a checksum, so anything
+    written without compression is still read back as-is.
+
+
+==============================================================================*/
+
+#ifndef PAWN_REDIS_COMPRESS_H
+#define PAWN_REDIS_COMPRESS_H
+
+#include <string>
+
+namespace Compress {
+std::string pack(const std::string& in);
+bool unpack(const std::string& in, std::string& out);
+bool isPacked(const std::string& in);
+};
+
+#endif
@@ -26,12 +26,64 @@
 ==============================================================================*/
 
 #include "impl.hpp"
+#include "compress.hpp"
+
+#include <clocale>
+
+#if defined WIN32 || defined _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <locale.h>
+#endif
 
 int Impl::context_count;
 std::map<int, Impl::clientData> Impl::clients;
 std::map<std::string, std::string> Impl::subscriptions;
-std::stack<Impl::message> Impl::message_stack;
-std::mutex Impl::message_stack_mutex;
+std::deque<Impl::message> Impl::message_queues[Impl::MESSAGE_PRIORITIES];
+std::mutex Impl::message_mutex;
+std::map<std::pair<int, std::string>, std::string> Impl::conflated_messages;
+std::vector<std::string> Impl::payload_pool;
+std::map<int, Impl::queueStats> Impl::queue_stats;
+Impl::queueStats Impl::total_stats;
+std::mutex Impl::stats_mutex;
+long long Impl::tick_latency = 0;
+int Impl::alert_depth = 0;
+int Impl::alert_latency = 0;
+bool Impl::depth_alerted = false;
+bool Impl::latency_alerted = false;
+Impl::messageBatch Impl::active_batch = { -1, {}, 0 };
+int Impl::batch_count;
+int Impl::dispatch_budget;
+std::map<AMX*, unsigned int> Impl::amx_generations;
+unsigned int Impl::amx_generation_count;
+int Impl::iterator_count;
+std::map<int, Impl::scanIterator> Impl::iterators;
+std::vector<Impl::streamConsumer*> Impl::stopped_consumers;
+
+std::map<int, Impl::connection*> Impl::connections;
+std::thread Impl::io_thread;
+std::atomic<bool> Impl::io_running;
+std::deque<Impl::ioTask> Impl::io_queue;
+std::mutex Impl::io_mutex;
+std::condition_variable Impl::io_cv;
+std::deque<std::function<void()>> Impl::completions;
+std::mutex Impl::completions_mutex;
+std::map<std::string, std::vector<std::function<void(cpp_redis::reply&)>>> Impl::inflight;
+std::mutex Impl::inflight_mutex;
+std::atomic<unsigned int> Impl::write_epoch;
+std::vector<Impl::ioTask> Impl::publish_buffer;
+std::map<int, Impl::shardSubscription*> Impl::shards;
+std::map<int, std::chrono::steady_clock::time_point> Impl::shard_retries;
+std::mutex Impl::shard_mutex;
+
+int Impl::lock_count;
+std::map<int, Impl::distLock*> Impl::locks;
+std::vector<Impl::lockRequest*> Impl::lock_requests;
+std::mutex Impl::locks_mutex;
+std::condition_variable Impl::lock_cv;
+std::thread Impl::lock_thread;
+std::atomic<bool> Impl::lock_running;
 
 /*
     Note:
@@ -39,6 +91,9 @@ std::mutex Impl::message_stack_mutex;
     successful the returned value will represent a pseudo-ID which maps
     internally to a Redis context.
 
+    The connection itself is opened on the I/O worker, which owns it from then
+    on, and the main thread waits for the result.
+
     Parameters:
     - `host[]`: hostname or ip of redis server
     - `port`: port number for redis server
@@ -49,28 +104,35 @@ std::mutex Impl::message_stack_mutex;
     - `-1`: generic error
     - `-2`: cannot allocate redis context
 */
-int Impl::Connect(std::string host, int port, std::string auth, int& id)
+int Impl::Connect(std::string host, int port, std::string auth, int& id, std::string prefix)
 {
-    cpp_redis::client* client = new cpp_redis::client();
-    client->connect(host, port);
-
-    if (auth.length() > 0) {
-        auto req = client->auth(auth);
-        client->sync_commit();
-        auto r = req.get();
+    int client_id = context_count;
+    int ret = 0;
 
-        if (r.is_error()) {
-            logprintf("ERROR: %s", r.error().c_str());
-            return 2;
+    runJob([client_id, host, port, auth, prefix, &ret]() {
+        cpp_redis::client* client = openClient(host, port, auth);
+        if (client == nullptr) {
+            ret = 2;
+            return;
         }
+
+        connection* conn = new connection();
+        conn->client = client;
+        conn->auth = auth;
+        conn->prefix = prefix;
+        connections[client_id] = conn;
+    });
+
+    if (ret) {
+        return ret;
     }
 
     clientData cd;
-    cd.client = client;
+    cd.isClient = true;
     cd.host = host;
     cd.port = port;
     cd.auth = auth;
-    clients[context_count] = cd;
+    clients[client_id] = cd;
 
     id = context_count++;
 
@@ -79,115 +141,280 @@ int Impl::Connect(std::string host, int port, std::string auth, int& id)
 
 int Impl::Disconnect(int client_id)
 {
-    cpp_redis::client* client;
-    int err = clientFromID(client_id, client);
-    if (err) {
-        return err;
+    if (!isClient(client_id)) {
+        return 1;
     }
 
+    SetWriteBehind(client_id, 0);
+    dropLocks(client_id);
+    flushPublishes();
+
     clients.erase(client_id);
 
+    // queued behind any writes still waiting to go out on this client
+    enqueue(ioTask{ client_id, {}, nullptr, [client_id]() {
+        auto found = connections.find(client_id);
+        if (found == connections.end()) {
+            return;
+        }
+        closeConnection(found->second);
+        connections.erase(found);
+    } });
+
     return 0;
 }
 
-int Impl::Command(int client_id, std::string command)
+/*
+    Note:
+    Connects to a Redis Cluster. `host` and `port` can be any node in the
+    cluster, the slot map is read from it with `CLUSTER SLOTS` and from then on
+    every command is sent to the node that owns the hash slot of its key.
+    `MOVED` and `ASK` redirects are followed by the I/O worker, and `MOVED`
+    updates the slot map so later commands go straight to the new owner.
+
+    The returned ID is used with the same natives as a regular client.
+*/
+int Impl::ConnectCluster(std::string host, int port, std::string auth, int& id, std::string prefix)
 {
-    cpp_redis::client* client;
-    int err = clientFromID(client_id, client);
-    if (err) {
-        return 1;
-    }
+    int client_id = context_count;
+    int ret = 0;
 
-    std::vector<std::string> cmd = split(command);
-    auto req = client->send(cmd);
-    client->sync_commit();
-    auto r = req.get();
+    runJob([client_id, host, port, auth, prefix, &ret]() {
+        cpp_redis::client* seed = openClient(host, port, auth);
+        if (seed == nullptr) {
+            ret = 2;
+            return;
+        }
 
-    if (r.is_error()) {
-        logprintf("ERROR: %s", r.error().c_str());
-        return 2;
+        connection* conn = new connection();
+        conn->client = seed;
+        conn->auth = auth;
+        conn->cluster = true;
+        conn->prefix = prefix;
+        conn->nodes[host + ":" + std::to_string(port)] = seed;
+        conn->slots.assign(16384, host + ":" + std::to_string(port));
+
+        ret = loadSlots(conn, host);
+        if (ret) {
+            closeConnection(conn);
+            return;
+        }
+
+        connections[client_id] = conn;
+    });
+
+    if (ret) {
+        return ret;
     }
 
+    clientData cd;
+    cd.isClient = true;
+    cd.cluster = true;
+    cd.host = host;
+    cd.port = port;
+    cd.auth = auth;
+    clients[client_id] = cd;
+
+    id = context_count++;
+
     return 0;
 }
 
-int Impl::Exists(int client_id, std::string key)
+/*
+    Note:
+    Connects to whichever server the Sentinels currently report as the master
+    for `name`. `sentinels` is a comma separated list of "host:port" addresses
+    which are tried in order. A subscriber on the first Sentinel that answers
+    listens for `+switch-master` and when the master changes the I/O worker
+    opens a connection to the new one and swaps it in behind the same ID, so
+    the handle held by Pawn stays valid across a failover.
+*/
+int Impl::ConnectSentinel(std::string sentinels, std::string name, std::string auth, int& id, std::string prefix)
 {
-    cpp_redis::client* client;
-    int err = clientFromID(client_id, client);
-    if (err) {
-        return 0;
+    std::vector<std::pair<std::string, int>> addrs;
+    std::istringstream iss(sentinels);
+    std::string addr;
+    while (std::getline(iss, addr, ',')) {
+        size_t colon = addr.rfind(':');
+        if (colon == std::string::npos) {
+            addrs.push_back(std::make_pair(addr, 26379));
+        } else {
+            addrs.push_back(std::make_pair(addr.substr(0, colon), std::atoi(addr.c_str() + colon + 1)));
+        }
+    }
+    if (addrs.empty()) {
+        return 1;
     }
 
-    auto req = client->exists(std::vector<std::string>{ key });
-    client->sync_commit();
-    auto r = req.get();
+    int client_id = context_count;
+    int ret = 0;
+    std::string master;
 
-    if (r.is_error()) {
-        logprintf("ERROR: %s", r.error().c_str());
-        return 0;
+    runJob([client_id, addrs, name, auth, prefix, &ret, &master]() {
+        size_t sentinel = 0;
+        master = resolveMaster(addrs, name, sentinel);
+        if (master.empty()) {
+            logprintf("ERROR: no sentinel knows a master named '%s'", name.c_str());
+            ret = 2;
+            return;
+        }
+
+        size_t colon = master.rfind(':');
+        cpp_redis::client* client = openClient(master.substr(0, colon), std::atoi(master.c_str() + colon + 1), auth);
+        if (client == nullptr) {
+            ret = 2;
+            return;
+        }
+
+        connection* conn = new connection();
+        conn->client = client;
+        conn->auth = auth;
+        conn->sentinels = addrs;
+        conn->master = name;
+        conn->masterAddr = master;
+        conn->prefix = prefix;
+
+        // on every (re)connect to the sentinel the master is looked up again
+        // in case a switch happened while the subscriber was disconnected.
+        conn->watcher = new cpp_redis::subscriber();
+        conn->watcher->connect(addrs[sentinel].first, addrs[sentinel].second,
+            [client_id](const std::string&, std::size_t, cpp_redis::connect_state status) {
+                if (status == cpp_redis::connect_state::ok) {
+                    enqueue(ioTask{ client_id, {}, nullptr, [client_id]() {
+                        switchMaster(client_id, "");
+                    } });
+                }
+            },
+            0, -1, 1000);
+        conn->watcher->subscribe("+switch-master", [client_id, name](const std::string&, const std::string& msg) {
+            // <master name> <old ip> <old port> <new ip> <new port>
+            std::istringstream iss(msg);
+            std::string master, oldIp, oldPort, newIp, newPort;
+            iss >> master >> oldIp >> oldPort >> newIp >> newPort;
+
+            if (master == name && !newIp.empty()) {
+                std::string addr = newIp + ":" + newPort;
+                enqueue(ioTask{ client_id, {}, nullptr, [client_id, addr]() {
+                    switchMaster(client_id, addr);
+                } });
+            }
+        });
+        conn->watcher->commit();
+
+        connections[client_id] = conn;
+    });
+
+    if (ret) {
+        return ret;
     }
 
-    return static_cast<int>(r.as_integer());
+    // the master at the time of connecting, conn->masterAddr follows switches
+    size_t colon = master.rfind(':');
+    clientData cd;
+    cd.isClient = true;
+    cd.host = master.substr(0, colon);
+    cd.port = std::atoi(master.c_str() + colon + 1);
+    cd.auth = auth;
+    clients[client_id] = cd;
+
+    id = context_count++;
+
+    return 0;
 }
 
-int Impl::SetString(int client_id, std::string key, std::string value)
+/*
+    Note:
+    Adds a read replica to a client. Once a client has replicas and a read
+    policy other than READ_MASTER, the read-only natives send their commands
+    to a replica unless the call asks for a fresh read. Replication is
+    asynchronous so a read from a replica may not see a write made just
+    before it.
+*/
+int Impl::AddReplica(int client_id, std::string host, int port)
 {
-    cpp_redis::client* client;
-    int err = clientFromID(client_id, client);
-    if (err) {
+    if (!isClient(client_id)) {
         return 1;
     }
 
-    auto req = client->set(key, value);
-    client->sync_commit();
-    auto r = req.get();
+    int ret = 0;
 
-    if (r.is_error()) {
-        logprintf("ERROR: %s", r.error().c_str());
-        return 1;
-    }
+    runJob([client_id, host, port, &ret]() {
+        // cluster replicas only hold their own master's slots so reads can't
+        // be spread over them the same way.
+        auto found = connections.find(client_id);
+        if (found == connections.end() || found->second->cluster) {
+            ret = 1;
+            return;
+        }
 
-    return 0;
+        cpp_redis::client* client = openClient(host, port, found->second->auth);
+        if (client == nullptr) {
+            ret = 2;
+            return;
+        }
+
+        replica* rep = new replica();
+        rep->client = client;
+        rep->latency = 0;
+        found->second->replicas.push_back(rep);
+        if (found->second->readPolicy == READ_MASTER) {
+            found->second->readPolicy = READ_ROUND_ROBIN;
+        }
+    });
+
+    return ret;
 }
 
-int Impl::GetString(int client_id, std::string key, std::string& value)
+int Impl::SetReadPolicy(int client_id, int policy)
 {
-    cpp_redis::client* client;
-    int err = clientFromID(client_id, client);
-    if (err) {
+    if (!isClient(client_id) || policy < READ_MASTER || policy > READ_LEAST_LATENCY) {
         return 1;
     }
 
-    auto req = client->get(key);
-    client->sync_commit();
-    auto r = req.get();
+    enqueue(ioTask{ client_id, {}, nullptr, [client_id, policy]() {
+        auto found = connections.find(client_id);
+        if (found != connections.end()) {
+            found->second->readPolicy = policy;
+        }
+    } });
 
-    if (r.is_error()) {
-        logprintf("ERROR: %s", r.error().c_str());
+    return 0;
+}
+
+/*
+    Note:
+    Once enabled, SET and HSET values of at least `threshold` bytes are
+    compressed on the I/O worker before being sent. Values that don't shrink
+    are stored as they are. A threshold of 0 turns it off for writes only.
+    After any call, GET and HGET replies on the client that carry the
+    compression header are expanded, so values written by another server or
+    before compression was turned off still read back correctly. Clients that
+    never call it get every value back exactly as stored.
+*/
+int Impl::SetCompression(int client_id, int threshold)
+{
+    if (!isClient(client_id) || threshold < 0) {
         return 1;
-    } else if (r.get_type() == cpp_redis::reply::type::null) {
-        return 2;
-    } else if (r.get_type() != cpp_redis::reply::type::bulk_string) {
-        return 3;
-    } else {
-        value = r.as_string();
     }
 
+    enqueue(ioTask{ client_id, {}, nullptr, [client_id, threshold]() {
+        auto found = connections.find(client_id);
+        if (found != connections.end()) {
+            found->second->compressAbove = threshold;
+            found->second->compressReads = true;
+        }
+    } });
+
     return 0;
 }
 
-int Impl::SetInt(int client_id, std::string key, int value)
+int Impl::Command(int client_id, std::string command)
 {
-    cpp_redis::client* client;
-    int err = clientFromID(client_id, client);
-    if (err) {
+    if (!isClient(client_id)) {
         return 1;
     }
 
-    auto req = client->set(key, std::to_string(value));
-    client->sync_commit();
-    auto r = req.get();
+    auto r = request(client_id, split(command)).get();
 
     if (r.is_error()) {
         logprintf("ERROR: %s", r.error().c_str());
@@ -197,338 +424,3784 @@ int Impl::SetInt(int client_id, std::string key, int value)
     return 0;
 }
 
-int Impl::GetInt(int client_id, std::string key, int& value)
+int Impl::Exists(int client_id, std::string key, bool fresh)
 {
-    cpp_redis::client* client;
-    int err = clientFromID(client_id, client);
-    if (err) {
-        return 1;
+    if (!isClient(client_id)) {
+        return 0;
     }
 
-    auto req = client->get(key);
-    client->sync_commit();
-    auto r = req.get();
+    auto r = read(client_id, { "EXISTS", key }, !fresh).get();
 
     if (r.is_error()) {
         logprintf("ERROR: %s", r.error().c_str());
-        return 2;
-    } else if (r.get_type() == cpp_redis::reply::type::null) {
-        return 3;
-    } else if (r.get_type() != cpp_redis::reply::type::bulk_string) {
-        return 4;
-    } else {
-        value = std::atoi(r.as_string().c_str());
+        return 0;
     }
 
-    return 0;
+    return static_cast<int>(r.as_integer());
 }
 
-int Impl::SetFloat(int client_id, std::string key, float value)
+/*
+    Note:
+    `ttl` is in milliseconds and is sent with the SET itself so the key never
+    exists without its expiry. Plain sets are queued without waiting, with
+    SET_NX or SET_XX the reply is waited for and 2 is returned if the key was
+    not set because the condition failed.
+*/
+int Impl::SetString(int client_id, std::string key, std::string value, int ttl, int flags)
 {
-    cpp_redis::client* client;
-    int err = clientFromID(client_id, client);
-    if (err) {
+    if (!isClient(client_id)) {
         return 1;
     }
 
-    auto req = client->set(key, std::to_string(value));
-    client->sync_commit();
-    auto r = req.get();
+    std::vector<std::string> command = { "SET", key, value };
+    if (ttl > 0) {
+        command.push_back("PX");
+        command.push_back(formatNumber(ttl));
+    }
+    if (flags & SET_NX) {
+        command.push_back("NX");
+    } else if (flags & SET_XX) {
+        command.push_back("XX");
+    }
+
+    if (!(flags & (SET_NX | SET_XX))) {
+        post(client_id, std::move(command));
+        return 0;
+    }
+
+    ++write_epoch;
+    auto r = request(client_id, std::move(command)).get();
 
     if (r.is_error()) {
         logprintf("ERROR: %s", r.error().c_str());
         return 1;
+    } else if (r.is_null()) {
+        return 2;
     }
 
     return 0;
 }
 
-int Impl::GetFloat(int client_id, std::string key, float& value)
+int Impl::GetString(int client_id, std::string key, std::string& value, bool fresh)
 {
-    cpp_redis::client* client;
-    int err = clientFromID(client_id, client);
-    if (err) {
+    if (!isClient(client_id)) {
         return 1;
     }
 
-    auto req = client->get(key);
-    client->sync_commit();
-    auto r = req.get();
+    auto r = read(client_id, { "GET", key }, !fresh).get();
 
     if (r.is_error()) {
         logprintf("ERROR: %s", r.error().c_str());
-        return 2;
+        return 1;
     } else if (r.get_type() == cpp_redis::reply::type::null) {
-        return 3;
+        return 2;
     } else if (r.get_type() != cpp_redis::reply::type::bulk_string) {
-        return 4;
+        return 3;
     } else {
-        value = static_cast<float>(std::atof(r.as_string().c_str()));
+        value = r.as_string();
     }
 
     return 0;
 }
 
-int Impl::SetHString(int client_id, std::string key, std::string field, std::string value)
+/*
+    Note:
+    Arrays are stored as one binary value, four little-endian bytes per cell,
+    so a whole inventory is a single SET instead of one write per slot. Values
+    whose length isn't a multiple of four weren't written by SetArray and
+    return 5.
+*/
+int Impl::SetArray(int client_id, std::string key, const std::vector<int>& data, int ttl, int flags)
 {
-    cpp_redis::client* client;
-    int err = clientFromID(client_id, client);
-    if (err) {
-        return 1;
+    return SetString(client_id, key, packCells(data), ttl, flags);
+}
+
+int Impl::GetArray(int client_id, std::string key, std::vector<int>& data, bool fresh)
+{
+    std::string raw;
+    int ret = GetString(client_id, key, raw, fresh);
+    if (ret) {
+        return ret;
     }
 
-    auto req = client->hset(key, field, value);
-    client->sync_commit();
-    auto r = req.get();
+    if (!unpackCells(raw, data)) {
+        return 5;
+    }
 
-    if (r.is_error()) {
-        logprintf("ERROR: %s", r.error().c_str());
+    return 0;
+}
+
+/*
+    Note:
+    Asynchronous versions of GetString and GetHString. The native returns as
+    soon as the read is queued and the callback is called from ProcessTick
+    with the value. Identical reads that are already in flight, from any
+    script, share the one request.
+
+    Callback error values match the return values of the synchronous natives:
+    0 for success, 1 for a Redis error, 2 for a missing key and 3 for a value
+    of the wrong type.
+*/
+int Impl::GetStringAsync(AMX* amx, int client_id, std::string key, std::string callback)
+{
+    if (!isClient(client_id)) {
         return 1;
     }
 
+    unsigned int generation = amxGeneration(amx);
+
+    coalesce(client_id, { "GET", key }, true, [amx, generation, client_id, key, callback](cpp_redis::reply& r) {
+        int error;
+        std::string value = readValue(r, error);
+        complete([amx, generation, client_id, key, callback, value, error]() {
+            if (!amxAlive(amx, generation)) {
+                return;
+            }
+
+            int idx;
+            if (amx_FindPublic(amx, callback.c_str(), &idx) != AMX_ERR_NONE) {
+                logprintf("ERROR: Redis callback '%s' not found", callback.c_str());
+                return;
+            }
+
+            cell amx_key, amx_value, ret;
+            cell* phys_addr;
+            amx_Push(amx, error);
+            amx_PushString(amx, &amx_value, &phys_addr, value.c_str(), 0, 0);
+            amx_PushString(amx, &amx_key, &phys_addr, key.c_str(), 0, 0);
+            amx_Push(amx, client_id);
+            amx_Exec(amx, &ret, idx);
+            amx_Release(amx, amx_value);
+        });
+    });
+
     return 0;
 }
 
-int Impl::GetHString(int client_id, std::string key, std::string field, std::string& value)
+int Impl::GetHStringAsync(AMX* amx, int client_id, std::string key, std::string field, std::string callback)
 {
-    cpp_redis::client* client;
-    int err = clientFromID(client_id, client);
-    if (err) {
+    if (!isClient(client_id)) {
         return 1;
     }
 
-    auto req = client->hget(key, field);
-    client->sync_commit();
-    auto r = req.get();
+    unsigned int generation = amxGeneration(amx);
+
+    auto deliver = [amx, generation, client_id, key, field, callback](std::string value, int error) {
+        complete([amx, generation, client_id, key, field, callback, value, error]() {
+            if (!amxAlive(amx, generation)) {
+                return;
+            }
+
+            int idx;
+            if (amx_FindPublic(amx, callback.c_str(), &idx) != AMX_ERR_NONE) {
+                logprintf("ERROR: Redis callback '%s' not found", callback.c_str());
+                return;
+            }
+
+            cell amx_key, amx_field, amx_value, ret;
+            cell* phys_addr;
+            amx_Push(amx, error);
+            amx_PushString(amx, &amx_value, &phys_addr, value.c_str(), 0, 0);
+            amx_PushString(amx, &amx_field, &phys_addr, field.c_str(), 0, 0);
+            amx_PushString(amx, &amx_key, &phys_addr, key.c_str(), 0, 0);
+            amx_Push(amx, client_id);
+            amx_Exec(amx, &ret, idx);
+            amx_Release(amx, amx_value);
+        });
+    };
+
+    writeCache* cache = cacheFromID(client_id);
+    std::string cached;
+    bool flushed = false;
+    if (cache != nullptr && cacheLookup(cache, key, field, cached, flushed)) {
+        deliver(cached, 0);
+        return 0;
+    }
+
+    coalesce(client_id, { "HGET", key, field }, !flushed, [deliver](cpp_redis::reply& r) {
+        int error;
+        std::string value = readValue(r, error);
+        deliver(value, error);
+    });
+
+    return 0;
+}
 
+std::string Impl::readValue(cpp_redis::reply& r, int& error)
+{
     if (r.is_error()) {
-        logprintf("ERROR: %s", r.error().c_str());
-        return 1;
+        reportError(r.error());
+        error = 1;
     } else if (r.get_type() == cpp_redis::reply::type::null) {
-        return 2;
+        error = 2;
     } else if (r.get_type() != cpp_redis::reply::type::bulk_string) {
-        return 3;
+        error = 3;
     } else {
-        value = r.as_string();
+        error = 0;
+        return r.as_string();
     }
 
-    return 0;
+    return "";
 }
 
-int Impl::HDel(int client_id, std::string key, std::string field)
+int Impl::SetInt(int client_id, std::string key, int value, int ttl, int flags)
 {
-    cpp_redis::client* client;
-    int err = clientFromID(client_id, client);
-    if (err) {
+    return SetString(client_id, key, formatNumber(value), ttl, flags);
+}
+
+int Impl::GetInt(int client_id, std::string key, int& value, bool fresh)
+{
+    if (!isClient(client_id)) {
         return 1;
     }
 
-    auto req = client->hdel(key, std::vector<std::string>{ field });
-    client->sync_commit();
-    auto r = req.get();
+    auto r = read(client_id, { "GET", key }, !fresh).get();
 
     if (r.is_error()) {
         logprintf("ERROR: %s", r.error().c_str());
         return 2;
+    } else if (r.get_type() == cpp_redis::reply::type::null) {
+        return 3;
+    } else if (r.get_type() != cpp_redis::reply::type::bulk_string) {
+        return 4;
+    } else if (!parseNumber(r.as_string(), value)) {
+        return 5;
     }
 
     return 0;
 }
 
-int Impl::HExists(int client_id, std::string key, std::string field)
+int Impl::SetFloat(int client_id, std::string key, float value, int ttl, int flags)
 {
-    cpp_redis::client* client;
-    int err = clientFromID(client_id, client);
-    if (err) {
+    return SetString(client_id, key, formatNumber(value), ttl, flags);
+}
+
+int Impl::GetFloat(int client_id, std::string key, float& value, bool fresh)
+{
+    if (!isClient(client_id)) {
         return 1;
     }
 
-    auto req = client->hexists(key, field);
-    client->sync_commit();
-    auto r = req.get();
+    auto r = read(client_id, { "GET", key }, !fresh).get();
 
     if (r.is_error()) {
         logprintf("ERROR: %s", r.error().c_str());
-        return 0;
+        return 2;
+    } else if (r.get_type() == cpp_redis::reply::type::null) {
+        return 3;
+    } else if (r.get_type() != cpp_redis::reply::type::bulk_string) {
+        return 4;
+    } else if (!parseNumber(r.as_string(), value)) {
+        return 5;
     }
 
-    return static_cast<int>(r.as_integer());
+    return 0;
 }
 
-int Impl::HIncrBy(int client_id, std::string key, std::string field, int incr)
+/*
+    Note:
+    A field `ttl` (milliseconds) uses HPEXPIRE, which needs Redis 7.4 or newer.
+    The HSET and HPEXPIRE are queued together so they go out in the same
+    write. Fields with a TTL skip the write-behind cache, any pending write to
+    the field is dropped since the new value replaces it anyway.
+*/
+int Impl::SetHString(int client_id, std::string key, std::string field, std::string value, int ttl)
 {
-    cpp_redis::client* client;
-    int err = clientFromID(client_id, client);
-    if (err) {
+    if (!isClient(client_id)) {
         return 1;
     }
 
-    auto req = client->hincrby(key, field, incr);
-    client->sync_commit();
-    auto r = req.get();
+    writeCache* cache = cacheFromID(client_id);
+    if (ttl > 0) {
+        std::vector<ioTask> tasks;
+        tasks.push_back(ioTask{ client_id, { "HSET", key, field, value }, logReply, nullptr });
+        tasks.push_back(ioTask{ client_id, { "HPEXPIRE", key, formatNumber(ttl), "FIELDS", "1", field }, logReply, nullptr });
+        ++write_epoch;
 
-    if (r.is_error()) {
-        logprintf("ERROR: %s", r.error().c_str());
-        return 1;
+        if (cache != nullptr) {
+            std::lock_guard<std::mutex> lock(cache->mutex);
+            cache->dirty.erase(std::make_pair(key, field));
+            enqueue(std::move(tasks));
+        } else {
+            enqueue(std::move(tasks));
+        }
+
+        return 0;
     }
 
+    if (cache != nullptr) {
+        std::lock_guard<std::mutex> lock(cache->mutex);
+        pendingWrite& w = cache->dirty[std::make_pair(key, field)];
+        w.hasValue = true;
+        w.value = value;
+        w.incr = 0;
+        w.incrFloat = 0.0;
+        return 0;
+    }
+
+    post(client_id, { "HSET", key, field, value });
+
     return 0;
 }
 
-int Impl::HIncrByFloat(int client_id, std::string key, std::string field, float incr)
+int Impl::GetHString(int client_id, std::string key, std::string field, std::string& value, bool fresh)
 {
-    cpp_redis::client* client;
-    int err = clientFromID(client_id, client);
-    if (err) {
+    if (!isClient(client_id)) {
         return 1;
     }
 
-    auto req = client->hincrbyfloat(key, field, incr);
-    client->sync_commit();
-    auto r = req.get();
+    writeCache* cache = cacheFromID(client_id);
+    bool flushed = false;
+    if (cache != nullptr && cacheLookup(cache, key, field, value, flushed)) {
+        return 0;
+    }
+
+    auto r = read(client_id, { "HGET", key, field }, !fresh && !flushed).get();
 
     if (r.is_error()) {
         logprintf("ERROR: %s", r.error().c_str());
         return 1;
+    } else if (r.get_type() == cpp_redis::reply::type::null) {
+        return 2;
+    } else if (r.get_type() != cpp_redis::reply::type::bulk_string) {
+        return 3;
+    } else {
+        value = r.as_string();
     }
 
     return 0;
 }
 
-int Impl::Subscribe(AMX* amx, std::string host, int port, std::string auth, std::string channel, std::string callback, int& id)
+int Impl::SetHInt(int client_id, std::string key, std::string field, int value, int ttl)
 {
-    cpp_redis::subscriber* sub = new cpp_redis::subscriber();
-    sub->connect(host, port);
+    return SetHString(client_id, key, field, formatNumber(value), ttl);
+}
 
-    if (auth.length() > 0) {
-        sub->auth(auth);
-    }
+/*
+    Note:
+    Returns 5 if the field holds something that isn't a number rather than
+    quietly handing back 0, the same code GetInt and GetFloat use. Other
+    return values match GetHString.
+*/
+int Impl::GetHInt(int client_id, std::string key, std::string field, int& value, bool fresh)
+{
+    std::string raw;
+    int ret = GetHString(client_id, key, field, raw, fresh);
+    if (ret) {
+        return ret;
+    }
+
+    if (!parseNumber(raw, value)) {
+        return 5;
+    }
+
+    return 0;
+}
+
+int Impl::SetHFloat(int client_id, std::string key, std::string field, float value, int ttl)
+{
+    return SetHString(client_id, key, field, formatNumber(value), ttl);
+}
+
+int Impl::GetHFloat(int client_id, std::string key, std::string field, float& value, bool fresh)
+{
+    std::string raw;
+    int ret = GetHString(client_id, key, field, raw, fresh);
+    if (ret) {
+        return ret;
+    }
+
+    if (!parseNumber(raw, value)) {
+        return 5;
+    }
+
+    return 0;
+}
+
+int Impl::SetHArray(int client_id, std::string key, std::string field, const std::vector<int>& data, int ttl)
+{
+    return SetHString(client_id, key, field, packCells(data), ttl);
+}
+
+int Impl::GetHArray(int client_id, std::string key, std::string field, std::vector<int>& data, bool fresh)
+{
+    std::string raw;
+    int ret = GetHString(client_id, key, field, raw, fresh);
+    if (ret) {
+        return ret;
+    }
+
+    if (!unpackCells(raw, data)) {
+        return 5;
+    }
+
+    return 0;
+}
+
+int Impl::HDel(int client_id, std::string key, std::string field)
+{
+    if (!isClient(client_id)) {
+        return 1;
+    }
+
+    writeCache* cache = cacheFromID(client_id);
+    if (cache != nullptr) {
+        std::lock_guard<std::mutex> lock(cache->mutex);
+        cache->dirty.erase(std::make_pair(key, field));
+    }
+
+    post(client_id, { "HDEL", key, field });
+
+    return 0;
+}
+
+int Impl::HExists(int client_id, std::string key, std::string field, bool fresh)
+{
+    if (!isClient(client_id)) {
+        return 1;
+    }
+
+    writeCache* cache = cacheFromID(client_id);
+    std::string cached;
+    bool flushed = false;
+    if (cache != nullptr && cacheLookup(cache, key, field, cached, flushed)) {
+        return 1;
+    }
+
+    auto r = read(client_id, { "HEXISTS", key, field }, !fresh && !flushed).get();
+
+    if (r.is_error()) {
+        logprintf("ERROR: %s", r.error().c_str());
+        return 0;
+    }
+
+    return static_cast<int>(r.as_integer());
+}
+
+int Impl::HIncrBy(int client_id, std::string key, std::string field, int incr)
+{
+    if (!isClient(client_id)) {
+        return 1;
+    }
+
+    writeCache* cache = cacheFromID(client_id);
+    if (cache != nullptr) {
+        std::lock_guard<std::mutex> lock(cache->mutex);
+        cache->dirty[std::make_pair(key, field)].incr += incr;
+        return 0;
+    }
+
+    post(client_id, { "HINCRBY", key, field, formatNumber(incr) });
+
+    return 0;
+}
+
+int Impl::HIncrByFloat(int client_id, std::string key, std::string field, float incr)
+{
+    if (!isClient(client_id)) {
+        return 1;
+    }
+
+    writeCache* cache = cacheFromID(client_id);
+    if (cache != nullptr) {
+        std::lock_guard<std::mutex> lock(cache->mutex);
+        cache->dirty[std::make_pair(key, field)].incrFloat += incr;
+        return 0;
+    }
+
+    post(client_id, { "HINCRBYFLOAT", key, field, formatNumber(incr) });
+
+    return 0;
+}
+
+int Impl::ZAdd(int client_id, std::string key, std::string member, float score)
+{
+    if (!isClient(client_id)) {
+        return 1;
+    }
+
+    post(client_id, { "ZADD", key, formatNumber(score), member });
+
+    return 0;
+}
+
+int Impl::ZIncrBy(int client_id, std::string key, std::string member, float incr, float& score)
+{
+    if (!isClient(client_id)) {
+        return 1;
+    }
+
+    auto r = request(client_id, { "ZINCRBY", key, formatNumber(incr), member }).get();
+
+    if (r.is_error()) {
+        logprintf("ERROR: %s", r.error().c_str());
+        return 2;
+    } else if (r.get_type() != cpp_redis::reply::type::bulk_string) {
+        return 4;
+    } else if (!parseNumber(r.as_string(), score)) {
+        return 5;
+    }
+
+    return 0;
+}
+
+int Impl::ZRem(int client_id, std::string key, std::string member)
+{
+    if (!isClient(client_id)) {
+        return 1;
+    }
+
+    post(client_id, { "ZREM", key, member });
+
+    return 0;
+}
+
+int Impl::ZScore(int client_id, std::string key, std::string member, float& score, bool fresh)
+{
+    if (!isClient(client_id)) {
+        return 1;
+    }
+
+    auto r = read(client_id, { "ZSCORE", key, member }, !fresh).get();
+
+    if (r.is_error()) {
+        logprintf("ERROR: %s", r.error().c_str());
+        return 2;
+    } else if (r.get_type() == cpp_redis::reply::type::null) {
+        return 3;
+    } else if (r.get_type() != cpp_redis::reply::type::bulk_string) {
+        return 4;
+    } else if (!parseNumber(r.as_string(), score)) {
+        return 5;
+    }
+
+    return 0;
+}
+
+/*
+    Note:
+    Fetches a range of a sorted set along with the scores in a single round
+    trip. The reply from `WITHSCORES` is a flat array of member, score pairs
+    which is unpacked here so the native only has to copy it into Pawn.
+*/
+int Impl::ZRange(int client_id, std::string key, int start, int stop, bool reverse, std::vector<std::pair<std::string, float>>& result, bool fresh)
+{
+    if (!isClient(client_id)) {
+        return 1;
+    }
+
+    auto r = read(client_id, { reverse ? "ZREVRANGE" : "ZRANGE", key, formatNumber(start), formatNumber(stop), "WITHSCORES" }, !fresh).get();
+
+    if (r.is_error()) {
+        logprintf("ERROR: %s", r.error().c_str());
+        return 2;
+    } else if (!r.is_array()) {
+        return 4;
+    }
+
+    auto items = r.as_array();
+    result.clear();
+    result.reserve(items.size() / 2);
+    int ret = 0;
+    for (size_t i = 0; i + 1 < items.size(); i += 2) {
+        float score = 0.0;
+        if (!parseNumber(items[i + 1].as_string(), score)) {
+            ret = 5;
+        }
+        result.push_back(std::make_pair(items[i].as_string(), score));
+    }
+
+    return ret;
+}
+
+/*
+    Note:
+    Looks up the rank of many members at once. All the `ZRANK`/`ZREVRANK`
+    commands are queued together so the I/O worker sends them with a single
+    commit and the whole batch costs one round trip instead of one per member.
+    Members that aren't in the set are given a rank of -1.
+*/
+int Impl::ZRankBatch(int client_id, std::string key, const std::vector<std::string>& members, bool reverse, std::vector<int>& ranks, bool fresh)
+{
+    if (!isClient(client_id)) {
+        return 1;
+    }
+
+    std::vector<std::future<cpp_redis::reply>> reqs;
+    reqs.reserve(members.size());
+    for (auto& member : members) {
+        reqs.push_back(read(client_id, { reverse ? "ZREVRANK" : "ZRANK", key, member }, !fresh));
+    }
+
+    ranks.clear();
+    ranks.reserve(members.size());
+    int ret = 0;
+    for (auto& req : reqs) {
+        auto r = req.get();
+
+        if (r.is_error()) {
+            logprintf("ERROR: %s", r.error().c_str());
+            ret = 2;
+            ranks.push_back(-1);
+        } else if (r.is_integer()) {
+            ranks.push_back(static_cast<int>(r.as_integer()));
+        } else {
+            ranks.push_back(-1);
+        }
+    }
+
+    return ret;
+}
+
+/*
+    Note:
+    With `batched` set, every message waiting for the subscription when
+    amx_tick reaches it is handed to the callback in one call along with a
+    batch handle, which the script reads the messages from with BatchNext.
+
+    With `conflate` set, a message that arrives while an older one with the
+    same key is still queued replaces it. The key is the part of the message
+    before `delimiter`, or the channel name if there's no delimiter.
+*/
+int Impl::Subscribe(AMX* amx, std::string host, int port, std::string auth, std::string channel, std::string callback, int& id, subscribeOptions options)
+{
+    int client_id = context_count;
+    unsigned int generation = amxGeneration(amx);
+    cpp_redis::subscriber* sub = new cpp_redis::subscriber();
+    options.filters = std::make_shared<filterSet>();
+    addQueueStats(client_id);
+    auto source = std::make_shared<const messageSource>(messageSource{ channel, callback });
+
+    runJob([sub, client_id, amx, generation, options, host, port, auth, channel, source]() {
+        sub->connect(host, port);
+
+        if (auth.length() > 0) {
+            sub->auth(auth);
+        }
+
+        auto receive = [client_id, amx, generation, options, source](const std::string& chan, const std::string& msg) {
+            if (!options.keyChannels) {
+                if (acceptMessage(options, msg)) {
+                    pushMessage(subscriptionMessage(client_id, amx, generation, options, source, chan, msg), msg);
+                }
+                return;
+            }
+
+            // __keyspace@<db>__:<key> channels carry the event as the payload
+            std::string key = chan.substr(chan.find("__:") + 3);
+            if ((options.keyEvents.empty() || msg == options.keyEvents) && acceptMessage(options, key)) {
+                pushMessage(subscriptionMessage(client_id, amx, generation, options, source, chan, msg), key);
+            }
+        };
+
+        if (options.keyspace) {
+            sub->psubscribe(channel, receive);
+        } else {
+            sub->subscribe(channel, receive);
+        }
+
+        sub->commit();
+    });
 
     clientData cd;
     cd.subscriber = sub;
+    cd.amx = amx;
     cd.channel = channel;
     cd.host = host;
     cd.port = port;
     cd.auth = auth;
     cd.isPubSub = true;
-    clients[context_count] = cd;
+    cd.pattern = options.keyspace;
+    cd.filters = options.filters;
+    clients[client_id] = cd;
+
+    id = context_count++;
+
+    return 0;
+}
+
+/*
+    Note:
+    Subscribes to the notifications of database `db`. With KEYSPACE_EVENTS
+    that's the keyevent channels, one per event, and `events` is an event name
+    such as "expired" or a pattern like "*". With KEYSPACE_KEYS it's the
+    keyspace channels, one per key, so the prefix is matched by Redis itself
+    and `events` has to be a single event name or empty/"*" for all of them.
+    The server only publishes these when notify-keyspace-events is set (e.g.
+    "Ex" for keyevent expiry, "Kx" for keyspace), that is left to the server
+    configuration. Either way the callback gets the event and the key.
+*/
+int Impl::SubscribeKeyspace(AMX* amx, std::string host, int port, std::string auth, int db, std::string events, std::string prefix, std::string callback, int& id, subscribeOptions options, int mode)
+{
+    options.keyspace = true;
+    options.keyPrefix = prefix;
+
+    std::string pattern;
+    if (mode == KEYSPACE_KEYS) {
+        options.keyChannels = true;
+        options.keyEvents = events == "*" ? "" : events;
+        pattern = "__keyspace@" + formatNumber(db) + "__:";
+        for (char c : prefix) {
+            if (c == '*' || c == '?' || c == '[' || c == ']' || c == '\\') {
+                pattern += '\\';
+            }
+            pattern += c;
+        }
+        pattern += '*';
+    } else if (mode == KEYSPACE_EVENTS) {
+        pattern = "__keyevent@" + formatNumber(db) + "__:" + (events.empty() ? "*" : events);
+    } else {
+        return 1;
+    }
+
+    return Subscribe(amx, host, port, auth, pattern, callback, id, options);
+}
+
+/*
+    Note:
+    Filters are checked on the subscriber's own thread so messages the script
+    would throw away anyway never take up queue space or a callback. A message
+    has to pass every filter added to the subscription. Keyspace subscriptions
+    also drop keys outside their prefix here, keyevent messages carry the key
+    as the payload.
+*/
+int Impl::AddFilter(int client_id, messageFilter filter)
+{
+    clientData cd;
+    if (clientDataFromID(client_id, cd) || !cd.isPubSub || !cd.filters) {
+        return 1;
+    }
+
+    std::lock_guard<std::mutex> lock(cd.filters->mutex);
+    cd.filters->filters.push_back(filter);
+
+    return 0;
+}
+
+int Impl::ClearFilters(int client_id)
+{
+    clientData cd;
+    if (clientDataFromID(client_id, cd) || !cd.isPubSub || !cd.filters) {
+        return 1;
+    }
+
+    std::lock_guard<std::mutex> lock(cd.filters->mutex);
+    cd.filters->filters.clear();
+
+    return 0;
+}
+
+bool Impl::acceptMessage(const subscribeOptions& options, const std::string& msg)
+{
+    if (matchMessage(options, msg)) {
+        return true;
+    }
+    if (options.filters) {
+        ++options.filters->dropped;
+    }
+    return false;
+}
+
+bool Impl::matchMessage(const subscribeOptions& options, const std::string& msg)
+{
+    if (options.keyspace && msg.compare(0, options.keyPrefix.length(), options.keyPrefix) != 0) {
+        return false;
+    }
+    if (!options.filters) {
+        return true;
+    }
+
+    std::lock_guard<std::mutex> lock(options.filters->mutex);
+    for (auto& f : options.filters->filters) {
+        switch (f.type) {
+        case FILTER_EXCLUDE_PREFIX:
+            if (msg.compare(0, f.value.length(), f.value) == 0) {
+                return false;
+            }
+            break;
+
+        case FILTER_CONTAINS:
+            if (msg.find(f.value) == std::string::npos) {
+                return false;
+            }
+            break;
+
+        case FILTER_FIELD: {
+            size_t start = 0;
+            for (int i = 0; i < f.field && start != std::string::npos; ++i) {
+                start = msg.find(f.delimiter, start);
+                if (start != std::string::npos) {
+                    start += f.delimiter.length();
+                }
+            }
+            if (start == std::string::npos) {
+                return false;
+            }
+            size_t end = msg.find(f.delimiter, start);
+            if (msg.compare(start, end == std::string::npos ? std::string::npos : end - start, f.value) != 0) {
+                return false;
+            }
+            break;
+        }
+        }
+    }
+
+    return true;
+}
+
+// the payload isn't copied here, pushMessage puts it in a pooled buffer
+Impl::message Impl::subscriptionMessage(int client_id, AMX* amx, unsigned int generation, const subscribeOptions& options, const std::shared_ptr<const messageSource>& source, const std::string& chan, const std::string& msg)
+{
+    message m;
+    m.clientId = client_id;
+    m.amx = amx;
+    m.generation = generation;
+    m.priority = options.priority;
+    m.batched = options.batched;
+    m.source = source;
+
+    if (options.keyspace) {
+        m.keyspace = true;
+        m.event = options.keyChannels ? msg : chan.substr(chan.find("__:") + 3);
+    }
+
+    if (options.conflate) {
+        m.conflated = true;
+        m.conflateKey = options.delimiter.empty() ? chan : msg.substr(0, msg.find(options.delimiter));
+    }
+
+    return m;
+}
+
+/*
+    Note:
+    Sharded pub/sub. SSUBSCRIBE has to be sent to the node that owns the hash
+    slot of the channel and the cpp_redis subscriber doesn't know the command,
+    so each sharded subscription keeps a plain connection to that node and
+    reads the pushes itself. `client_id` is the Redis client whose slot map is
+    used, for a client that isn't a cluster it's just the server it talks to.
+
+    When a slot moves the old owner ends the subscription with a sunsubscribe
+    nobody asked for, the slot map is then reloaded and the subscription
+    reopened on the new owner. The same happens when the connection drops,
+    for example when the node crashes or fails over, and if the new owner
+    can't be reached yet it is tried again every second from io_tick.
+*/
+int Impl::SSubscribe(AMX* amx, int client_id, std::string channel, std::string callback, int& id, subscribeOptions options)
+{
+    clientData cd;
+    if (clientDataFromID(client_id, cd) || !cd.isClient) {
+        return 1;
+    }
+
+    shardSubscription* shard = new shardSubscription();
+    shard->id = context_count;
+    shard->clientId = client_id;
+    shard->channel = channel;
+    shard->fallback = cd.host + ":" + formatNumber(cd.port);
+    shard->amx = amx;
+    shard->generation = amxGeneration(amx);
+    shard->source = std::make_shared<const messageSource>(messageSource{ channel, callback });
+    shard->options = options;
+    shard->options.filters = std::make_shared<filterSet>();
+    shard->closing = false;
+    addQueueStats(shard->id);
+
+    int ret = 0;
+    runJob([shard, &ret]() {
+        ret = shardConnect(shard);
+        if (ret == 0) {
+            shards[shard->id] = shard;
+        }
+    });
+
+    if (ret) {
+        dropQueueStats(shard->id);
+        delete shard;
+        return ret;
+    }
+
+    clientData sd;
+    sd.isPubSub = true;
+    sd.sharded = true;
+    sd.filters = shard->options.filters;
+    sd.amx = amx;
+    sd.channel = channel;
+    sd.host = cd.host;
+    sd.port = cd.port;
+    sd.auth = cd.auth;
+    clients[context_count] = sd;
+
+    id = context_count++;
+
+    return 0;
+}
+
+// runs on the I/O worker
+int Impl::shardConnect(shardSubscription* shard)
+{
+    auto found = connections.find(shard->clientId);
+    if (found == connections.end()) {
+        return 1;
+    }
+    connection* conn = found->second;
+
+    std::string addr;
+    if (conn->cluster) {
+        addr = conn->slots[keySlot(shard->channel)];
+    } else if (!conn->masterAddr.empty()) {
+        addr = conn->masterAddr;
+    } else {
+        addr = shard->fallback;
+    }
+    size_t colon = addr.rfind(':');
+
+    // lets a late notice from an earlier connection be told apart
+    unsigned int link_id = ++shard->linkId;
+
+    cpp_redis::network::redis_connection* link = new cpp_redis::network::redis_connection();
+    try {
+        link->connect(addr.substr(0, colon), std::atoi(addr.c_str() + colon + 1),
+            [shard, link_id](cpp_redis::network::redis_connection&) {
+                shardLost(shard, link_id);
+            },
+            [shard, link_id](cpp_redis::network::redis_connection&, cpp_redis::reply& r) {
+                shardReply(shard, link_id, r);
+            },
+            1000);
+    } catch (cpp_redis::redis_error e) {
+        reportError(e.what());
+        delete link;
+        return 2;
+    }
+
+    if (!conn->auth.empty()) {
+        link->send({ "AUTH", conn->auth });
+    }
+    link->send({ "SSUBSCRIBE", shard->channel });
+    link->commit();
+
+    shard->link = link;
+    shard->addr = addr;
+
+    return 0;
+}
+
+// runs on the subscription's network thread
+void Impl::shardReply(shardSubscription* shard, unsigned int link_id, cpp_redis::reply& r)
+{
+    if (r.is_error()) {
+        reportError(r.error());
+        return;
+    }
+    if (!r.is_array() || r.as_array().size() < 3) {
+        return;
+    }
+
+    auto& parts = r.as_array();
+    const std::string& kind = parts[0].as_string();
+
+    if (kind == "smessage" && acceptMessage(shard->options, parts[2].as_string())) {
+        pushMessage(subscriptionMessage(shard->id, shard->amx, shard->generation, shard->options, shard->source,
+            parts[1].as_string(), parts[2].as_string()), parts[2].as_string());
+    } else if (kind == "sunsubscribe") {
+        shardLost(shard, link_id);
+    }
+}
+
+// runs on the subscription's network thread, after a sunsubscribe nobody
+// asked for or when the connection drops
+void Impl::shardLost(shardSubscription* shard, unsigned int link_id)
+{
+    if (shard->closing) {
+        return;
+    }
+
+    int sub_id = shard->id;
+    enqueue(ioTask{ -1, {}, nullptr, [sub_id, link_id]() {
+        shardMoved(sub_id, link_id);
+    } });
+}
+
+// runs on the I/O worker. `link_id` is the connection that was lost, if the
+// subscription has moved on since then there is nothing left to do.
+void Impl::shardMoved(int sub_id, unsigned int link_id)
+{
+    auto found = shards.find(sub_id);
+    if (found == shards.end() || found->second->linkId != link_id) {
+        return;
+    }
+    shardSubscription* shard = found->second;
+
+    if (shard->link != nullptr) {
+        shard->link->disconnect(true);
+        delete shard->link;
+        shard->link = nullptr;
+    }
+
+    // in case the slot map never arrives, shardReconnect cancels it
+    {
+        std::lock_guard<std::mutex> lock(shard_mutex);
+        shard_retries[sub_id] = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+    }
+
+    std::string host = shard->addr.substr(0, shard->addr.rfind(':'));
+    refreshSlots(shard->clientId, host, [sub_id, link_id]() {
+        shardReconnect(sub_id, link_id);
+    });
+}
+
+// runs on the I/O worker once the slot map has been refreshed
+void Impl::shardReconnect(int sub_id, unsigned int link_id)
+{
+    auto found = shards.find(sub_id);
+    if (found == shards.end() || found->second->linkId != link_id || found->second->link != nullptr) {
+        return;
+    }
+    shardSubscription* shard = found->second;
+
+    if (shardConnect(shard) == 0) {
+        shard->retrying = false;
+        std::lock_guard<std::mutex> lock(shard_mutex);
+        shard_retries.erase(sub_id);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(shard_mutex);
+        shard_retries[sub_id] = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+    }
+
+    // only the first failure is logged, retries go on quietly
+    if (!shard->retrying) {
+        shard->retrying = true;
+        std::string channel = shard->channel;
+        complete([channel]() {
+            logprintf("ERROR: could not resubscribe to sharded channel '%s', retrying", channel.c_str());
+        });
+    }
+}
+
+int Impl::Unsubscribe(int client_id)
+{
+    clientData cd;
+
+    int err = clientDataFromID(client_id, cd);
+    if (err || !cd.isPubSub) {
+        return 1;
+    }
+
+    if (cd.sharded) {
+        enqueue(ioTask{ client_id, {}, nullptr, [client_id]() {
+            auto found = shards.find(client_id);
+            if (found == shards.end()) {
+                return;
+            }
+            shardSubscription* shard = found->second;
+            shard->closing = true;
+            if (shard->link != nullptr) {
+                shard->link->disconnect(true);
+                delete shard->link;
+            }
+            delete shard;
+            shards.erase(found);
+        } });
+
+        dropQueueStats(client_id);
+        clients.erase(client_id);
+
+        return 0;
+    }
+
+    // the subscriber owns a connection and network thread of its own which
+    // would otherwise be left running for the life of the server.
+    enqueue(ioTask{ client_id, {}, nullptr, [cd]() {
+        if (cd.pattern) {
+            cd.subscriber->punsubscribe(cd.channel);
+        } else {
+            cd.subscriber->unsubscribe(cd.channel);
+        }
+        cd.subscriber->commit();
+        cd.subscriber->disconnect(true);
+        delete cd.subscriber;
+    } });
+
+    dropQueueStats(client_id);
+    clients.erase(client_id);
+
+    return 0;
+}
+
+int Impl::Publish(int client_id, std::string channel, std::string data, bool sharded)
+{
+    if (!isClient(client_id)) {
+        return 1;
+    }
+
+    // keep ordering with any async publishes made earlier this tick
+    flushPublishes();
+
+    auto r = request(client_id, { sharded ? "SPUBLISH" : "PUBLISH", channel, data }).get();
+
+    if (r.is_error()) {
+        logprintf("ERROR: %s", r.error().c_str());
+        return 2;
+    }
+
+    return 0;
+}
+
+/*
+    Note:
+    Async publishes are held until the next server tick and then queued on
+    the I/O worker together, so every publish made during a tick goes out in
+    a single write per connection. Errors are logged, nothing is waited on.
+*/
+int Impl::PublishAsync(int client_id, std::string channel, std::string data, bool sharded)
+{
+    if (!isClient(client_id)) {
+        return 1;
+    }
+
+    publish_buffer.push_back(ioTask{ client_id, { sharded ? "SPUBLISH" : "PUBLISH", channel, data }, logReply, nullptr });
+
+    return 0;
+}
+
+int Impl::PublishMulti(int client_id, const std::vector<std::string>& channels, std::string data)
+{
+    if (!isClient(client_id)) {
+        return 1;
+    }
+
+    for (auto& channel : channels) {
+        publish_buffer.push_back(ioTask{ client_id, { "PUBLISH", channel, data }, logReply, nullptr });
+    }
+
+    return 0;
+}
+
+void Impl::flushPublishes()
+{
+    if (publish_buffer.empty()) {
+        return;
+    }
+
+    std::vector<ioTask> tasks;
+    tasks.swap(publish_buffer);
+    enqueue(std::move(tasks));
+}
+
+/*
+    Note:
+    Appends an entry to a stream. The payload is stored under a single field
+    named `data` which is what `XConsume` hands to the Pawn callback. If
+    `maxlen` is above zero the stream is approximately trimmed to that size.
+*/
+int Impl::XAdd(int client_id, std::string stream, std::string data, int maxlen, std::string& id)
+{
+    if (!isClient(client_id)) {
+        return 1;
+    }
+
+    std::vector<std::string> cmd = { "XADD", stream };
+    if (maxlen > 0) {
+        cmd.push_back("MAXLEN");
+        cmd.push_back("~");
+        cmd.push_back(std::to_string(maxlen));
+    }
+    cmd.push_back("*");
+    cmd.push_back("data");
+    cmd.push_back(data);
+
+    auto r = request(client_id, cmd).get();
+
+    if (r.is_error()) {
+        logprintf("ERROR: %s", r.error().c_str());
+        return 2;
+    } else if (!r.is_string()) {
+        return 4;
+    } else {
+        id = r.as_string();
+    }
+
+    return 0;
+}
+
+/*
+    Note:
+    Starts a consumer group reader on a stream. The consumer gets its own
+    connection and thread which blocks on `XREADGROUP` and pushes each batch of
+    entries onto the message queue as a single message. A blocking read would
+    hold up every other client if it went through the I/O worker, so this is
+    the one connection the worker doesn't own. Entries are only acknowledged
+    once `amx_tick` has passed them to the Pawn callback, so any entries
+    delivered while the server was down are read back from the pending list
+    when the consumer starts again.
+*/
+int Impl::XConsume(AMX* amx, std::string host, int port, std::string auth, std::string stream, std::string group, std::string consumer, std::string callback, int batch, int& id)
+{
+    cpp_redis::client* client = new cpp_redis::client();
+    client->connect(host, port, nullptr, 1000, -1, 1000);
+
+    // this runs on the main thread, so a server that accepts the connection
+    // but never answers mustn't hold it up for good.
+    auto setup = [client](std::vector<std::string> command, cpp_redis::reply& r) {
+        auto req = client->send(command);
+        client->commit();
+        if (req.wait_for(std::chrono::milliseconds(1000)) != std::future_status::ready) {
+            logprintf("ERROR: Redis %s timed out", command[0].c_str());
+            return false;
+        }
+        r = req.get();
+        return true;
+    };
+
+    cpp_redis::reply r;
+    if (auth.length() > 0) {
+        if (!setup({ "AUTH", auth }, r) || r.is_error()) {
+            if (r.is_error()) {
+                logprintf("ERROR: %s", r.error().c_str());
+            }
+            client->disconnect(true);
+            delete client;
+            return 2;
+        }
+    }
+
+    if (!setup({ "XGROUP", "CREATE", stream, group, "$", "MKSTREAM" }, r)
+        || (r.is_error() && r.error().compare(0, 9, "BUSYGROUP") != 0)) {
+        if (r.is_error()) {
+            logprintf("ERROR: %s", r.error().c_str());
+        }
+        client->disconnect(true);
+        delete client;
+        return 2;
+    }
+
+    streamConsumer* sc = new streamConsumer();
+    sc->client = client;
+    sc->running = true;
+    sc->finished = false;
+    sc->amx = amx;
+    sc->generation = amxGeneration(amx);
+    sc->batch = batch > 0 ? batch : 1;
+    sc->stream = stream;
+    sc->group = group;
+    sc->consumer = consumer;
+    sc->callback = callback;
+    sc->source = std::make_shared<const messageSource>(messageSource{ stream, callback });
+
+    clientData cd;
+    cd.consumer = sc;
+    cd.host = host;
+    cd.port = port;
+    cd.auth = auth;
+    clients[context_count] = cd;
+
+    id = context_count++;
+    sc->id = id;
+    addQueueStats(id);
+    sc->thread = std::thread(streamWorker, sc);
+
+    return 0;
+}
+
+int Impl::XStop(int client_id)
+{
+    clientData cd;
+
+    int err = clientDataFromID(client_id, cd);
+    if (err || cd.consumer == nullptr) {
+        return 1;
+    }
+
+    // the worker may be blocked in XREADGROUP for up to a second, so it is
+    // joined later by reapConsumers rather than here on the main thread.
+    cd.consumer->running = false;
+    stopped_consumers.push_back(cd.consumer);
+
+    dropQueueStats(client_id);
+    clients.erase(client_id);
+
+    return 0;
+}
+
+void Impl::streamWorker(streamConsumer* sc)
+{
+    // start from the pending entries list then move on to new entries once
+    // everything that was delivered before a restart has been handled.
+    std::string cursor = "0";
+
+    while (sc->running) {
+        std::vector<std::string> acks;
+        {
+            std::lock_guard<std::mutex> lock(sc->acks_mutex);
+            acks.swap(sc->acks);
+        }
+        if (!acks.empty()) {
+            std::vector<std::string> cmd = { "XACK", sc->stream, sc->group };
+            cmd.insert(cmd.end(), acks.begin(), acks.end());
+            sc->client->send(cmd, [](cpp_redis::reply& r) {
+                if (r.is_error()) {
+                    reportError(r.error());
+                }
+            });
+        }
+
+        auto req = sc->client->send({ "XREADGROUP", "GROUP", sc->group, sc->consumer,
+            "COUNT", std::to_string(sc->batch), "BLOCK", "1000",
+            "STREAMS", sc->stream, cursor });
+
+        cpp_redis::reply r;
+        try {
+            sc->client->sync_commit();
+            r = req.get();
+        } catch (...) {
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+            continue;
+        }
+
+        if (r.is_error()) {
+            reportError(r.error());
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+            continue;
+        } else if (!r.is_array() || r.as_array().empty()) {
+            continue;
+        }
+
+        // reply is [[stream, [[id, [field, value, ...]], ...]]]
+        auto entries = r.as_array()[0].as_array()[1].as_array();
+        if (entries.empty()) {
+            cursor = ">";
+            continue;
+        }
+
+        // pending entries keep coming back until they're acknowledged, which
+        // only happens after the callback runs, so page through the history
+        // by ID rather than asking for the start of it again.
+        if (cursor != ">") {
+            cursor = entries.back().as_array()[0].as_string();
+        }
+
+        message m;
+        m.clientId = sc->id;
+        m.amx = sc->amx;
+        m.generation = sc->generation;
+        m.source = sc->source;
+        m.entries.reserve(entries.size());
+
+        for (auto& e : entries) {
+            streamEntry entry;
+            entry.id = e.as_array()[0].as_string();
+
+            auto& fields = e.as_array()[1];
+            if (fields.is_array()) {
+                auto& kv = fields.as_array();
+                for (size_t i = 0; i + 1 < kv.size(); i += 2) {
+                    if (i == 0 || kv[i].as_string() == "data") {
+                        entry.data = kv[i + 1].as_string();
+                    }
+                }
+            }
+
+            m.entries.push_back(entry);
+        }
+
+        pushMessage(std::move(m));
+    }
+
+    sc->client->disconnect(true);
+    delete sc->client;
+    sc->finished = true;
+}
+
+/*
+    Note:
+    Joins and frees stopped consumers whose worker has finished, or all of
+    them with `wait` when the plugin unloads, since a worker still running
+    after that would be running code that is no longer there.
+*/
+void Impl::reapConsumers(bool wait)
+{
+    for (auto it = stopped_consumers.begin(); it != stopped_consumers.end();) {
+        streamConsumer* sc = *it;
+        if (!wait && !sc->finished) {
+            ++it;
+            continue;
+        }
+        sc->thread.join();
+        delete sc;
+        it = stopped_consumers.erase(it);
+    }
+}
+
+/*
+    Note:
+    Starts a cursor based iteration using `SCAN`, `HSCAN` or `SSCAN`. The first
+    page is requested straight away without waiting for the reply. Every time a
+    page is taken by `ScanNext` the request for the page after it is queued so
+    it's already on its way back while the script works through the current
+    one.
+
+    Parameters:
+    - `command`: one of SCAN, HSCAN or SSCAN
+    - `key`: the hash or set to iterate, ignored for SCAN
+    - `pattern`: MATCH pattern, empty for all
+    - `count`: COUNT hint for each page, zero for the Redis default
+
+    A SCAN only walks the keys of the node it is sent to, so it is refused on
+    cluster clients rather than quietly covering a fraction of the keyspace.
+    HSCAN and SSCAN work on clusters, they go to the node owning `key`.
+*/
+int Impl::ScanBegin(int client_id, std::string command, std::string key, std::string pattern, int count, int& id)
+{
+    clientData cd;
+    if (clientDataFromID(client_id, cd) || !cd.isClient) {
+        return 1;
+    }
+    if (command == "SCAN" && cd.cluster) {
+        return 3;
+    }
+
+    scanIterator it;
+    it.clientId = client_id;
+    it.command.push_back(command);
+    if (command != "SCAN") {
+        it.command.push_back(key);
+    }
+    // cursor placeholder, filled in by scanFetch
+    it.command.push_back("0");
+    if (pattern.length() > 0) {
+        it.command.push_back("MATCH");
+        it.command.push_back(pattern);
+    }
+    if (count > 0) {
+        it.command.push_back("COUNT");
+        it.command.push_back(std::to_string(count));
+    }
+    it.pos = 0;
+    it.done = false;
+
+    scanFetch(it, "0");
+
+    iterators[iterator_count] = std::move(it);
+    id = iterator_count++;
+
+    return 0;
+}
+
+/*
+    Note:
+    Returns the next element of an iteration. For HSCAN the field is written to
+    `item` and its value to `value`. When the iteration is exhausted the
+    iterator is freed and 1 is returned.
+*/
+int Impl::ScanNext(int iter_id, std::string& item, std::string& value)
+{
+    auto found = iterators.find(iter_id);
+    if (found == iterators.end()) {
+        return 1;
+    }
+
+    scanIterator& it = found->second;
+    size_t step = it.command[0] == "HSCAN" ? 2 : 1;
+
+    while (it.pos + step > it.page.size()) {
+        if (it.done) {
+            iterators.erase(found);
+            return 1;
+        }
+
+        auto r = it.next.get();
+
+        if (r.is_error()) {
+            logprintf("ERROR: %s", r.error().c_str());
+            iterators.erase(found);
+            return 2;
+        } else if (!r.is_array() || r.as_array().size() != 2) {
+            iterators.erase(found);
+            return 4;
+        }
+
+        std::string cursor = r.as_array()[0].as_string();
+        it.page.clear();
+        for (auto& e : r.as_array()[1].as_array()) {
+            it.page.push_back(e.as_string());
+        }
+        it.pos = 0;
+
+        if (cursor == "0" || !isClient(it.clientId)) {
+            it.done = true;
+        } else {
+            scanFetch(it, cursor);
+        }
+    }
+
+    item = it.page[it.pos];
+    if (step == 2) {
+        value = it.page[it.pos + 1];
+    }
+    it.pos += step;
+
+    return 0;
+}
+
+int Impl::ScanEnd(int iter_id)
+{
+    if (iterators.erase(iter_id) == 0) {
+        return 1;
+    }
+
+    return 0;
+}
+
+void Impl::scanFetch(scanIterator& it, std::string cursor)
+{
+    it.command[it.command[0] == "SCAN" ? 1 : 2] = cursor;
+    it.next = request(it.clientId, it.command);
+}
+
+/*
+    Note:
+    A conflated message is queued as an empty placeholder the first time its
+    key is seen, with the payload kept in `conflated_messages`. Later messages
+    with the same key only replace that payload, so the queue holds at most
+    one entry per key and the placeholder keeps the key's place in line.
+*/
+void Impl::pushMessage(message m)
+{
+    int priority = std::min(std::max(m.priority, 0), MESSAGE_PRIORITIES - 1);
+
+    std::lock_guard<std::mutex> lock(message_mutex);
+
+    if (m.conflated) {
+        auto key = std::make_pair(m.clientId, m.conflateKey);
+        auto found = conflated_messages.find(key);
+        if (found != conflated_messages.end()) {
+            found->second.swap(m.msg);
+            statQueued(m.clientId, true);
+            return;
+        }
+        conflated_messages[key].swap(m.msg);
+    }
+
+    m.queued = std::chrono::steady_clock::now();
+    statQueued(m.clientId, false);
+    message_queues[priority].push_back(std::move(m));
+}
+
+/*
+    Note:
+    Subscription payloads are copied into buffers recycled from earlier
+    messages, so once the pool has warmed up a message costs no allocations
+    on either thread. Messages are moved from the subscriber thread through
+    the queue and into the callback, never copied. The pool is capped and
+    very large buffers aren't kept so one burst doesn't pin memory forever.
+*/
+void Impl::pushMessage(message m, const std::string& payload)
+{
+    int priority = std::min(std::max(m.priority, 0), MESSAGE_PRIORITIES - 1);
+
+    std::lock_guard<std::mutex> lock(message_mutex);
+
+    if (m.conflated) {
+        auto key = std::make_pair(m.clientId, m.conflateKey);
+        auto found = conflated_messages.find(key);
+        if (found != conflated_messages.end()) {
+            found->second.assign(payload);
+            statQueued(m.clientId, true);
+            return;
+        }
+        conflated_messages[key].assign(payload);
+    } else {
+        if (!payload_pool.empty()) {
+            m.msg.swap(payload_pool.back());
+            payload_pool.pop_back();
+        }
+        m.msg.assign(payload);
+    }
+
+    m.queued = std::chrono::steady_clock::now();
+    statQueued(m.clientId, false);
+    message_queues[priority].push_back(std::move(m));
+}
+
+/*
+    Note:
+    Queue statistics are kept per subscription (or stream consumer) and in
+    total. They have their own lock rather than message_mutex so they can be
+    read from inside a message callback, while amx_tick holds the queue.
+    Messages dropped by filters are counted in the subscription's filterSet
+    since that happens on the subscriber thread before anything is queued.
+*/
+void Impl::statQueued(int client_id, bool superseded)
+{
+    std::lock_guard<std::mutex> lock(stats_mutex);
+
+    // arrived while an unsubscribe was on its way, only the totals count it
+    auto found = queue_stats.find(client_id);
+    queueStats* sub = found == queue_stats.end() ? nullptr : &found->second;
+
+    for (queueStats* s : { sub, &total_stats }) {
+        if (s == nullptr) {
+            continue;
+        }
+        ++s->received;
+        if (superseded) {
+            ++s->conflated;
+            continue;
+        }
+        if (++s->depth > s->peak) {
+            s->peak = s->depth;
+        }
+    }
+}
+
+void Impl::statTaken(const message& m, bool delivered)
+{
+    long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m.queued).count();
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && ms >= LATENCY_LIMITS[bucket]) {
+        ++bucket;
+    }
+
+    std::lock_guard<std::mutex> lock(stats_mutex);
+
+    auto found = queue_stats.find(m.clientId);
+    queueStats* sub = found == queue_stats.end() ? nullptr : &found->second;
+
+    for (queueStats* s : { sub, &total_stats }) {
+        // the subscription has already been closed
+        if (s == nullptr) {
+            continue;
+        }
+        --s->depth;
+        if (!delivered) {
+            ++s->discarded;
+            continue;
+        }
+        ++s->dispatched;
+        ++s->latency[bucket];
+        s->maxLatency = std::max(s->maxLatency, ms);
+    }
+
+    if (delivered) {
+        tick_latency = std::max(tick_latency, ms);
+    }
+}
+
+/*
+    Note:
+    Logs once when the queue depth or the worst latency of a tick reaches its
+    threshold and once more when it has dropped back under half of it, the gap
+    stops a queue sitting right on the threshold from flooding the log.
+*/
+void Impl::checkQueueAlerts()
+{
+    long long depth;
+    long long latency;
+    {
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        depth = total_stats.depth;
+        latency = tick_latency;
+        tick_latency = 0;
+    }
+
+    if (alert_depth > 0) {
+        if (!depth_alerted && depth >= alert_depth) {
+            logprintf("WARNING: Redis message queue depth is %lld, the main thread isn't keeping up", depth);
+            depth_alerted = true;
+        } else if (depth_alerted && depth < alert_depth / 2) {
+            logprintf("Redis message queue depth is back to %lld", depth);
+            depth_alerted = false;
+        }
+    }
+
+    if (alert_latency > 0) {
+        if (!latency_alerted && latency >= alert_latency) {
+            logprintf("WARNING: Redis messages are waiting %lldms before being delivered", latency);
+            latency_alerted = true;
+        } else if (latency_alerted && latency < alert_latency / 2) {
+            logprintf("Redis message latency is back to %lldms", latency);
+            latency_alerted = false;
+        }
+    }
+}
+
+// created when a subscription or consumer starts, before any message can arrive
+void Impl::addQueueStats(int client_id)
+{
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    queue_stats[client_id] = queueStats();
+}
+
+void Impl::dropQueueStats(int client_id)
+{
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    queue_stats.erase(client_id);
+}
+
+int Impl::GetQueueStats(int client_id, queueStats& stats, long long& filtered)
+{
+    filtered = 0;
+
+    if (client_id == -1) {
+        for (auto& c : clients) {
+            if (c.second.filters) {
+                filtered += c.second.filters->dropped;
+            }
+        }
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        stats = total_stats;
+        return 0;
+    }
+
+    clientData cd;
+    if (clientDataFromID(client_id, cd) || (!cd.isPubSub && cd.consumer == nullptr)) {
+        return 1;
+    }
+    if (cd.filters) {
+        filtered = cd.filters->dropped;
+    }
+
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    auto found = queue_stats.find(client_id);
+    stats = found == queue_stats.end() ? queueStats() : found->second;
+
+    return 0;
+}
+
+// clears the counters but not the current depth, which is still queued. -1
+// resets the totals and every subscription along with them.
+int Impl::ResetQueueStats(int client_id)
+{
+    std::vector<queueStats*> reset;
+    std::lock_guard<std::mutex> lock(stats_mutex);
+
+    if (client_id == -1) {
+        for (auto& c : clients) {
+            if (c.second.filters) {
+                c.second.filters->dropped = 0;
+            }
+        }
+        for (auto& s : queue_stats) {
+            reset.push_back(&s.second);
+        }
+        reset.push_back(&total_stats);
+    } else {
+        clientData cd;
+        if (clientDataFromID(client_id, cd) || (!cd.isPubSub && cd.consumer == nullptr)) {
+            return 1;
+        }
+        if (cd.filters) {
+            cd.filters->dropped = 0;
+        }
+        auto found = queue_stats.find(client_id);
+        if (found != queue_stats.end()) {
+            reset.push_back(&found->second);
+        }
+    }
+
+    for (queueStats* s : reset) {
+        queueStats fresh;
+        fresh.depth = s->depth;
+        fresh.peak = s->depth;
+        *s = fresh;
+    }
+
+    return 0;
+}
+
+int Impl::SetQueueAlert(int depth, int latency)
+{
+    alert_depth = std::max(depth, 0);
+    alert_latency = std::max(latency, 0);
+    depth_alerted = false;
+    latency_alerted = false;
+
+    return 0;
+}
+
+static const size_t PAYLOAD_POOL_SIZE = 1024;
+static const size_t PAYLOAD_POOL_MAX_BUFFER = 65536;
+
+// the caller must hold message_mutex
+void Impl::recyclePayload(std::string& payload)
+{
+    if (payload.capacity() == 0 || payload.capacity() > PAYLOAD_POOL_MAX_BUFFER || payload_pool.size() >= PAYLOAD_POOL_SIZE) {
+        return;
+    }
+    payload_pool.push_back(std::move(payload));
+    payload_pool.back().clear();
+    payload.clear();
+}
+
+// the caller must hold message_mutex
+void Impl::takeConflated(message& m)
+{
+    auto found = conflated_messages.find(std::make_pair(m.clientId, m.conflateKey));
+    if (found == conflated_messages.end()) {
+        return;
+    }
+    m.msg.swap(found->second);
+    conflated_messages.erase(found);
+}
+
+/*
+    Note:
+    Pulls every other message for the same subscription out of `queue` into
+    the active batch, the caller must hold message_mutex. The batch is only
+    readable for the duration of the callback, see dispatchBatch.
+*/
+void Impl::takeBatch(message& first, std::deque<message>& queue)
+{
+    active_batch.id = batch_count++;
+    active_batch.pos = 0;
+    active_batch.messages.clear();
+    active_batch.messages.push_back(std::move(first.msg));
+    statTaken(first, true);
+
+    std::deque<message> rest;
+    for (auto& m : queue) {
+        if (m.batched && m.clientId == first.clientId && m.generation == first.generation) {
+            if (m.conflated) {
+                takeConflated(m);
+            }
+            statTaken(m, true);
+            active_batch.messages.push_back(std::move(m.msg));
+        } else {
+            rest.push_back(std::move(m));
+        }
+    }
+    queue.swap(rest);
+}
+
+// calls the script with the batch taken by takeBatch, without message_mutex
+void Impl::dispatchBatch(const message& first)
+{
+    int idx;
+    int error = amx_FindPublic(first.amx, first.source->callback.c_str(), &idx);
+    if (error != AMX_ERR_NONE) {
+        logprintf("ERROR: Redis amx_FindPublic returned %d for callback '%s' channel '%s'",
+            error,
+            first.source->callback.c_str(),
+            first.source->channel.c_str());
+    } else {
+        cell ret;
+        amx_Push(first.amx, active_batch.messages.size());
+        amx_Push(first.amx, active_batch.id);
+        amx_Push(first.amx, first.clientId);
+        amx_Exec(first.amx, &ret, idx);
+    }
+
+    active_batch.id = -1;
+}
+
+int Impl::BatchNext(int batch_id, std::string& msg)
+{
+    if (batch_id != active_batch.id || active_batch.pos >= active_batch.messages.size()) {
+        return 1;
+    }
+
+    msg = active_batch.messages[active_batch.pos++];
+
+    return 0;
+}
+
+int Impl::SetDispatchBudget(int usec)
+{
+    if (usec < 0) {
+        return 1;
+    }
+
+    dispatch_budget = usec;
+
+    return 0;
+}
+
+/*
+    Note:
+    Messages are dispatched oldest first, all of the high priority queue
+    before any of the normal one and so on. With a dispatch budget set, the
+    loop stops once the budget is used up and whatever is left waits for the
+    next tick, so a flood on a low priority channel only delays itself.
+
+    message_mutex is only held while a message is taken off its queue, never
+    while the script runs. A callback can unsubscribe, unload a script or
+    call a native that waits on a subscriber thread, and those threads need
+    the lock to queue what they receive. A tick dispatches at most the number
+    of messages that were queued when it started, so messages arriving during
+    the callbacks can't keep it going forever.
+*/
+void Impl::amx_tick()
+{
+    std::unique_lock<std::mutex> lock(message_mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        return;
+    }
+
+    message m;
+    auto start = std::chrono::steady_clock::now();
+    int priority = 0;
+    size_t remaining = 0;
+    for (auto& queue : message_queues) {
+        remaining += queue.size();
+    }
+
+    for (; remaining > 0; --remaining) {
+        while (priority < MESSAGE_PRIORITIES && message_queues[priority].empty()) {
+            ++priority;
+        }
+        if (priority == MESSAGE_PRIORITIES) {
+            break;
+        }
+        if (dispatch_budget > 0 && std::chrono::steady_clock::now() - start >= std::chrono::microseconds(dispatch_budget)) {
+            break;
+        }
+
+        recyclePayload(m.msg);
+        m = std::move(message_queues[priority].front());
+        message_queues[priority].pop_front();
+
+        if (m.conflated) {
+            takeConflated(m);
+        }
+
+        // queued before the script that subscribed was unloaded
+        if (!amxAlive(m.amx, m.generation)) {
+            statTaken(m, false);
+            continue;
+        }
+
+        if (m.batched) {
+            takeBatch(m, message_queues[priority]);
+            lock.unlock();
+            dispatchBatch(m);
+            lock.lock();
+            for (auto& msg : active_batch.messages) {
+                recyclePayload(msg);
+            }
+            active_batch.messages.clear();
+            continue;
+        }
+
+        statTaken(m, true);
+
+        lock.unlock();
+        dispatchMessage(m);
+        lock.lock();
+    }
+
+    recyclePayload(m.msg);
+    lock.unlock();
+
+    checkQueueAlerts();
+}
+
+// calls the script for one message, without message_mutex
+void Impl::dispatchMessage(message& m)
+{
+    AMX* amx = m.amx;
+    int amx_idx = -1;
+    cell amx_addr;
+    cell amx_ret;
+    cell* phys_addr;
+
+    int error = amx_FindPublic(amx, m.source->callback.c_str(), &amx_idx);
+
+    if (error == AMX_ERR_NONE && !m.entries.empty()) {
+        cell amx_id_addr;
+        std::vector<std::string> acks;
+        acks.reserve(m.entries.size());
+
+        for (auto& e : m.entries) {
+            // an earlier entry's callback unloaded the script, the rest stay
+            // pending and are delivered again to the next consumer.
+            if (!amxAlive(amx, m.generation)) {
+                break;
+            }
+
+            amx_Push(amx, e.data.length());
+            amx_PushString(amx, &amx_addr, &phys_addr, e.data.c_str(), 0, 0);
+            amx_PushString(amx, &amx_id_addr, &phys_addr, e.id.c_str(), 0, 0);
+            amx_Push(amx, m.clientId);
+
+            amx_Exec(amx, &amx_ret, amx_idx);
+            if (amxAlive(amx, m.generation)) {
+                amx_Release(amx, amx_id_addr);
+                amx_Release(amx, amx_addr);
+            }
+
+            acks.push_back(e.id);
+        }
+
+        // the consumer may have been stopped while the batch was
+        // queued, in which case the entries stay pending.
+        clientData cd;
+        if (clientDataFromID(m.clientId, cd) == 0 && cd.consumer != nullptr) {
+            std::lock_guard<std::mutex> lock(cd.consumer->acks_mutex);
+            cd.consumer->acks.insert(cd.consumer->acks.end(), acks.begin(), acks.end());
+        }
+    } else if (error == AMX_ERR_NONE && m.keyspace) {
+        cell amx_event_addr;
+
+        amx_PushString(amx, &amx_addr, &phys_addr, m.msg.c_str(), 0, 0);
+        amx_PushString(amx, &amx_event_addr, &phys_addr, m.event.c_str(), 0, 0);
+        amx_Push(amx, m.clientId);
+
+        amx_Exec(amx, &amx_ret, amx_idx);
+        if (amxAlive(amx, m.generation)) {
+            amx_Release(amx, amx_event_addr);
+            amx_Release(amx, amx_addr);
+        }
+    } else if (error == AMX_ERR_NONE) {
+        /*
+        Note:
+        This is the part that calls the Pawn callback!
+        */
+        amx_Push(amx, m.msg.length());
+        amx_PushString(amx, &amx_addr, &phys_addr, m.msg.c_str(), 0, 0);
+        amx_Push(amx, m.clientId);
+
+        amx_Exec(amx, &amx_ret, amx_idx);
+        if (amxAlive(amx, m.generation)) {
+            amx_Release(amx, amx_addr);
+        }
+
+        if (amx_ret > 0) {
+            // todo: something clever with the return value...
+            // logprintf("return from amx was %d", amx_ret);
+        }
+    } else {
+        logprintf("ERROR: Redis amx_FindPublic returned %d for callback '%s' channel '%s'",
+            error,
+            m.source->callback.c_str(),
+            m.source->channel.c_str());
+    }
+}
+
+/*
+    Note:
+    Scripts are told apart by a generation number handed out when they load,
+    since a filterscript reloaded into the same memory gets the same AMX*.
+    Anything that will call back into a script later (subscriptions, stream
+    consumers, async reads and lock acquires) records the generation at the
+    time it was started and checks it is still current before calling in.
+    Unloading a script just forgets its generation, which invalidates all of
+    them at once, and then stops the subscriptions and consumers it started.
+*/
+void Impl::amxLoad(AMX* amx)
+{
+    amx_generations[amx] = ++amx_generation_count;
+}
+
+void Impl::amxUnload(AMX* amx)
+{
+    unsigned int generation = amxGeneration(amx);
+    amx_generations.erase(amx);
+
+    std::vector<int> subscribers;
+    std::vector<int> consumers;
+    for (auto& c : clients) {
+        if (c.second.isPubSub && c.second.amx == amx) {
+            subscribers.push_back(c.first);
+        } else if (c.second.consumer != nullptr && c.second.consumer->amx == amx) {
+            consumers.push_back(c.first);
+        }
+    }
+    for (int id : subscribers) {
+        Unsubscribe(id);
+    }
+    for (int id : consumers) {
+        XStop(id);
+    }
+
+    // otherwise the lock worker would keep extending them forever
+    dropLocks(amx, generation);
+
+    {
+        std::lock_guard<std::mutex> lock(locks_mutex);
+        for (auto it = lock_requests.begin(); it != lock_requests.end();) {
+            lockRequest* req = *it;
+            if (req->amx != amx) {
+                ++it;
+            } else if (req->waiting) {
+                req->cancelled = true;
+                ++it;
+            } else {
+                delete req;
+                it = lock_requests.erase(it);
+            }
+        }
+    }
+
+    // amx_tick never holds the lock while a script runs, so this is safe
+    // from inside a callback too.
+    {
+        std::lock_guard<std::mutex> lock(message_mutex);
+        for (auto& queue : message_queues) {
+            queue.erase(std::remove_if(queue.begin(), queue.end(), [amx](message& m) {
+                if (m.amx != amx) {
+                    return false;
+                }
+                if (m.conflated) {
+                    takeConflated(m);
+                }
+                statTaken(m, false);
+                return true;
+            }), queue.end());
+        }
+    }
+}
+
+unsigned int Impl::amxGeneration(AMX* amx)
+{
+    auto found = amx_generations.find(amx);
+    if (found == amx_generations.end()) {
+        return 0;
+    }
+    return found->second;
+}
+
+bool Impl::amxAlive(AMX* amx, unsigned int generation)
+{
+    auto found = amx_generations.find(amx);
+    return found != amx_generations.end() && found->second == generation;
+}
+
+/*
+    Note:
+    Turns write-behind caching on or off for a client. While it's on, hash
+    writes made through SetHString, HIncrBy and HIncrByFloat are held in memory
+    per key and field. Setting a field overwrites whatever was pending for it
+    and increments are summed, so a field that changes many times between
+    flushes is only written once. A background thread hands everything that is
+    pending to the I/O worker every `interval` milliseconds so it goes out in a
+    single pipeline.
+
+    Reads of a field that has a pending plain value are answered from memory.
+    Reads of a field with a pending increment flush the cache first and go to
+    the master, even with replicas added, so Redis returns the right total.
+
+    Passing an interval of zero flushes anything pending and turns the cache
+    off again.
+*/
+int Impl::SetWriteBehind(int client_id, int interval)
+{
+    auto found = clients.find(client_id);
+    if (found == clients.end() || !found->second.isClient) {
+        return 1;
+    }
+
+    writeCache* cache = found->second.cache;
+
+    if (interval <= 0) {
+        if (cache == nullptr) {
+            return 0;
+        }
+
+        cache->running = false;
+        cache->cv.notify_all();
+        cache->thread.join();
+
+        {
+            std::lock_guard<std::mutex> lock(cache->mutex);
+            cacheCommit(cache);
+        }
+
+        found->second.cache = nullptr;
+        delete cache;
+
+        return 0;
+    }
+
+    if (cache != nullptr) {
+        cache->interval = interval;
+        return 0;
+    }
+
+    cache = new writeCache();
+    cache->clientId = client_id;
+    cache->running = true;
+    cache->interval = interval;
+    cache->thread = std::thread(cacheWorker, cache);
+
+    found->second.cache = cache;
+
+    return 0;
+}
+
+/*
+    Note:
+    Sends everything pending in the write-behind cache and waits until Redis
+    has applied it. Replies on a connection come back in order so waiting on a
+    PING queued behind the writes is enough.
+*/
+int Impl::Flush(int client_id)
+{
+    writeCache* cache = cacheFromID(client_id);
+    if (cache == nullptr) {
+        return 1;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(cache->mutex);
+        cacheCommit(cache);
+    }
+
+    auto r = request(client_id, { "PING" }).get();
+
+    if (r.is_error()) {
+        logprintf("ERROR: %s", r.error().c_str());
+        return 2;
+    }
+
+    return 0;
+}
+
+Impl::writeCache* Impl::cacheFromID(int client_id)
+{
+    auto found = clients.find(client_id);
+    if (found == clients.end()) {
+        return nullptr;
+    }
+
+    return found->second.cache;
+}
+
+// `flushed` is set when the pending writes had to be sent first, the caller
+// must then read from the master since a replica may not have them yet.
+bool Impl::cacheLookup(writeCache* cache, std::string key, std::string field, std::string& value, bool& flushed)
+{
+    std::lock_guard<std::mutex> lock(cache->mutex);
+
+    auto found = cache->dirty.find(std::make_pair(key, field));
+    if (found == cache->dirty.end()) {
+        return false;
+    }
+
+    const pendingWrite& w = found->second;
+    if (w.hasValue && w.incr == 0 && w.incrFloat == 0.0) {
+        value = w.value;
+        return true;
+    }
+
+    // the commands are queued on the master connection ahead of the caller's
+    // read so there's no need to wait for the replies here.
+    cacheCommit(cache);
+    flushed = true;
+
+    return false;
+}
+
+/*
+    Note:
+    Queues every pending write on the I/O worker in one go so they are sent
+    with a single commit. The caller must hold the cache mutex, holding it
+    until the commands are queued means a read that misses the cache is always
+    sent after them.
+*/
+void Impl::cacheCommit(writeCache* cache)
+{
+    if (cache->dirty.empty()) {
+        return;
+    }
+
+    std::vector<ioTask> tasks;
+    tasks.reserve(cache->dirty.size());
+
+    for (auto& entry : cache->dirty) {
+        const std::string& key = entry.first.first;
+        const std::string& field = entry.first.second;
+        const pendingWrite& w = entry.second;
+
+        if (w.hasValue) {
+            tasks.push_back(ioTask{ cache->clientId, { "HSET", key, field, w.value }, logReply, nullptr });
+        }
+        if (w.incr != 0) {
+            tasks.push_back(ioTask{ cache->clientId, { "HINCRBY", key, field, formatNumber(w.incr) }, logReply, nullptr });
+        }
+        if (w.incrFloat != 0.0) {
+            tasks.push_back(ioTask{ cache->clientId, { "HINCRBYFLOAT", key, field, formatNumber(w.incrFloat) }, logReply, nullptr });
+        }
+    }
+    cache->dirty.clear();
+    ++write_epoch;
+
+    enqueue(std::move(tasks));
+}
+
+void Impl::cacheWorker(writeCache* cache)
+{
+    std::unique_lock<std::mutex> lock(cache->mutex);
+
+    while (cache->running) {
+        cache->cv.wait_for(lock, std::chrono::milliseconds(cache->interval), [cache] {
+            return !cache->running;
+        });
+
+        cacheCommit(cache);
+    }
+}
+
+/*
+    Note:
+    Distributed locks. A lock is a key set with SET NX PX to a random token
+    that only this lock knows, so releasing or extending it can check that the
+    key still belongs to us before touching it. While a lock is held the lock
+    worker extends its lease every third of the lease time, if an extension
+    finds the key gone or owned by someone else the lock is marked as lost.
+
+    Async acquires are retried by the lock worker until they succeed or time
+    out, instead of a script polling Redis from Pawn.
+*/
+static const char* LOCK_RELEASE = "if redis.call('get', KEYS[1]) == ARGV[1] then return redis.call('del', KEYS[1]) else return 0 end";
+static const char* LOCK_RENEW = "if redis.call('get', KEYS[1]) == ARGV[1] then return redis.call('pexpire', KEYS[1], ARGV[2]) else return 0 end";
+static const int LOCK_POLL = 50;
+
+int Impl::LockAcquire(AMX* amx, int client_id, std::string name, int lease, int& id)
+{
+    if (!isClient(client_id) || lease <= 0) {
+        return 1;
+    }
+
+    std::string token = lockToken();
+
+    ++write_epoch;
+    auto r = request(client_id, { "SET", name, token, "PX", formatNumber(lease), "NX" }).get();
+
+    if (r.is_error()) {
+        logprintf("ERROR: %s", r.error().c_str());
+        return 1;
+    } else if (r.is_null()) {
+        return 2;
+    }
+
+    std::lock_guard<std::mutex> lock(locks_mutex);
+    id = addLock(amx, amxGeneration(amx), client_id, name, token, lease);
+
+    return 0;
+}
+
+int Impl::LockAcquireAsync(AMX* amx, int client_id, std::string name, int lease, int timeout, std::string callback)
+{
+    if (!isClient(client_id) || lease <= 0) {
+        return 1;
+    }
+
+    lockRequest* req = new lockRequest();
+    req->amx = amx;
+    req->generation = amxGeneration(amx);
+    req->clientId = client_id;
+    req->name = name;
+    req->token = lockToken();
+    req->lease = lease;
+    req->callback = callback;
+    req->deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+    req->retryAt = std::chrono::steady_clock::now();
+    req->waiting = false;
+    req->cancelled = false;
+
+    {
+        std::lock_guard<std::mutex> lock(locks_mutex);
+        lock_requests.push_back(req);
+    }
+    lock_cv.notify_one();
+
+    return 0;
+}
+
+int Impl::LockRelease(int lock_id)
+{
+    distLock* l;
+    {
+        std::lock_guard<std::mutex> lock(locks_mutex);
+        auto found = locks.find(lock_id);
+        if (found == locks.end()) {
+            return 1;
+        }
+        l = found->second;
+        locks.erase(found);
+    }
+
+    if (l->held) {
+        post(l->clientId, { "EVAL", LOCK_RELEASE, "1", l->name, l->token });
+    }
+    delete l;
+
+    return 0;
+}
+
+int Impl::LockHeld(int lock_id)
+{
+    std::lock_guard<std::mutex> lock(locks_mutex);
+
+    auto found = locks.find(lock_id);
+    if (found == locks.end()) {
+        return 0;
+    }
+
+    return found->second->held ? 1 : 0;
+}
+
+/*
+    Note:
+    Releases every lock held through a client and drops its pending acquires
+    without calling their callbacks, used when the client goes away. An
+    acquire that is waiting on a reply is cleaned up by its reply handler, if
+    it did get the lock the lease simply runs out.
+*/
+void Impl::dropLocks(int client_id)
+{
+    std::lock_guard<std::mutex> lock(locks_mutex);
+
+    for (auto it = locks.begin(); it != locks.end();) {
+        distLock* l = it->second;
+        if (client_id != -1 && l->clientId != client_id) {
+            ++it;
+            continue;
+        }
+        if (l->held) {
+            post(l->clientId, { "EVAL", LOCK_RELEASE, "1", l->name, l->token });
+        }
+        delete l;
+        it = locks.erase(it);
+    }
+
+    for (auto it = lock_requests.begin(); it != lock_requests.end();) {
+        lockRequest* req = *it;
+        if (client_id != -1 && req->clientId != client_id) {
+            ++it;
+            continue;
+        }
+        if (req->waiting) {
+            req->cancelled = true;
+            ++it;
+            continue;
+        }
+        delete req;
+        it = lock_requests.erase(it);
+    }
+}
+
+// releases the locks taken by a script that is being unloaded
+void Impl::dropLocks(AMX* amx, unsigned int generation)
+{
+    std::lock_guard<std::mutex> lock(locks_mutex);
+
+    for (auto it = locks.begin(); it != locks.end();) {
+        distLock* l = it->second;
+        if (l->amx != amx || l->generation != generation) {
+            ++it;
+            continue;
+        }
+        if (l->held) {
+            post(l->clientId, { "EVAL", LOCK_RELEASE, "1", l->name, l->token });
+        }
+        delete l;
+        it = locks.erase(it);
+    }
+}
+
+// the caller must hold locks_mutex
+int Impl::addLock(AMX* amx, unsigned int generation, int client_id, std::string name, std::string token, int lease)
+{
+    distLock* l = new distLock();
+    l->amx = amx;
+    l->generation = generation;
+    l->clientId = client_id;
+    l->name = name;
+    l->token = token;
+    l->lease = lease;
+    l->held = true;
+    l->renewAt = std::chrono::steady_clock::now() + std::chrono::milliseconds(lease / 3);
+
+    int id = lock_count++;
+    locks[id] = l;
+
+    return id;
+}
+
+std::string Impl::lockToken()
+{
+    static std::mt19937_64 rng(std::random_device{}());
+
+    char buf[33];
+    snprintf(buf, sizeof(buf), "%016llx%016llx",
+        static_cast<unsigned long long>(rng()),
+        static_cast<unsigned long long>(rng()));
+
+    return buf;
+}
+
+void Impl::lockDeliver(lockRequest* req, int lock_id, int error)
+{
+    AMX* amx = req->amx;
+    unsigned int generation = req->generation;
+    int client_id = req->clientId;
+    std::string name = req->name;
+    std::string callback = req->callback;
+
+    complete([amx, generation, client_id, name, callback, lock_id, error]() {
+        if (!amxAlive(amx, generation)) {
+            // nobody is left to release it
+            if (lock_id != -1) {
+                LockRelease(lock_id);
+            }
+            return;
+        }
+
+        int idx;
+        if (amx_FindPublic(amx, callback.c_str(), &idx) != AMX_ERR_NONE) {
+            logprintf("ERROR: Redis callback '%s' not found", callback.c_str());
+            return;
+        }
+
+        cell amx_name, ret;
+        cell* phys_addr;
+        amx_Push(amx, error);
+        amx_Push(amx, lock_id);
+        amx_PushString(amx, &amx_name, &phys_addr, name.c_str(), 0, 0);
+        amx_Push(amx, client_id);
+        amx_Exec(amx, &ret, idx);
+        amx_Release(amx, amx_name);
+    });
+}
+
+void Impl::lockWorker()
+{
+    std::unique_lock<std::mutex> lock(locks_mutex);
+
+    while (lock_running) {
+        lock_cv.wait_for(lock, std::chrono::milliseconds(LOCK_POLL), [] {
+            return !lock_running;
+        });
+
+        auto now = std::chrono::steady_clock::now();
+
+        for (auto& entry : locks) {
+            distLock* l = entry.second;
+            if (!l->held || now < l->renewAt) {
+                continue;
+            }
+            l->renewAt = now + std::chrono::milliseconds(l->lease / 3);
+
+            int lock_id = entry.first;
+            std::string name = l->name;
+            enqueue(ioTask{ l->clientId, { "EVAL", LOCK_RENEW, "1", l->name, l->token, formatNumber(l->lease) }, [lock_id, name](cpp_redis::reply& r) {
+                if (r.is_error()) {
+                    // try again on the next renewal, the lease has time left
+                    reportError(r.error());
+                    return;
+                }
+                if (r.is_integer() && r.as_integer() == 1) {
+                    return;
+                }
+
+                {
+                    std::lock_guard<std::mutex> guard(locks_mutex);
+                    auto found = locks.find(lock_id);
+                    if (found != locks.end()) {
+                        found->second->held = false;
+                    }
+                }
+                reportError("lock '" + name + "' was lost before it was released");
+            }, nullptr });
+        }
+
+        for (auto it = lock_requests.begin(); it != lock_requests.end();) {
+            lockRequest* req = *it;
+            if (req->waiting || now < req->retryAt) {
+                ++it;
+                continue;
+            }
+
+            // the deadline is only checked after a failed attempt, so even a
+            // timeout of zero tries once.
+            req->waiting = true;
+            enqueue(ioTask{ req->clientId, { "SET", req->name, req->token, "PX", formatNumber(req->lease), "NX" }, [req](cpp_redis::reply& r) {
+                std::lock_guard<std::mutex> guard(locks_mutex);
+                req->waiting = false;
+
+                if (req->cancelled) {
+                    lock_requests.erase(std::find(lock_requests.begin(), lock_requests.end(), req));
+                    delete req;
+                    return;
+                }
+
+                if (r.is_error()) {
+                    reportError(r.error());
+                } else if (!r.is_null()) {
+                    lockDeliver(req, addLock(req->amx, req->generation, req->clientId, req->name, req->token, req->lease), 0);
+                    lock_requests.erase(std::find(lock_requests.begin(), lock_requests.end(), req));
+                    delete req;
+                    return;
+                }
+
+                auto now = std::chrono::steady_clock::now();
+                if (now >= req->deadline) {
+                    lockDeliver(req, -1, 2);
+                    lock_requests.erase(std::find(lock_requests.begin(), lock_requests.end(), req));
+                    delete req;
+                    return;
+                }
+
+                req->retryAt = now + std::chrono::milliseconds(LOCK_POLL);
+            }, nullptr });
+            ++it;
+        }
+    }
+}
+
+/*
+    Note:
+    The I/O worker is the only thread that touches the `cpp_redis::client`
+    connections. Natives never talk to Redis themselves, they queue an
+    `ioTask` and either wait on the reply (reads) or return straight away
+    (writes). The worker drains the whole queue each time it wakes and commits
+    once per connection, so everything queued in the same tick goes out as one
+    pipeline.
+
+    Replies are parsed on the client's network thread. Anything that needs to
+    run on the main thread afterwards, such as logging a failed write, is put
+    on the completion queue which `io_tick` drains from ProcessTick.
+*/
+void Impl::ioStart()
+{
+    io_running = true;
+    io_thread = std::thread(ioWorker);
+
+    lock_running = true;
+    lock_thread = std::thread(lockWorker);
+}
+
+void Impl::ioStop()
+{
+    // write-behind caches feed the I/O worker, so they are stopped and their
+    // last writes queued before it goes away.
+    for (auto& c : clients) {
+        if (c.second.cache != nullptr) {
+            SetWriteBehind(c.first, 0);
+        }
+    }
+
+    flushPublishes();
+
+    for (auto& c : clients) {
+        if (c.second.consumer != nullptr) {
+            c.second.consumer->running = false;
+            stopped_consumers.push_back(c.second.consumer);
+            c.second.consumer = nullptr;
+        }
+    }
+    reapConsumers(true);
+
+    {
+        std::lock_guard<std::mutex> lock(locks_mutex);
+        lock_running = false;
+    }
+    lock_cv.notify_all();
+
+    if (lock_thread.joinable()) {
+        lock_thread.join();
+    }
+    dropLocks(-1);
+
+    {
+        std::lock_guard<std::mutex> lock(io_mutex);
+        io_running = false;
+    }
+    io_cv.notify_all();
+
+    if (io_thread.joinable()) {
+        io_thread.join();
+    }
+
+    for (auto& s : shards) {
+        s.second->closing = true;
+        if (s.second->link != nullptr) {
+            s.second->link->disconnect(true);
+            delete s.second->link;
+        }
+        delete s.second;
+    }
+    shards.clear();
+
+    for (auto& c : connections) {
+        closeConnection(c.second);
+    }
+    connections.clear();
+}
+
+void Impl::ioWorker()
+{
+    std::deque<ioTask> tasks;
+    std::set<cpp_redis::client*> pending;
+
+    auto commitPending = [&pending]() {
+        for (auto client : pending) {
+            try {
+                client->commit();
+            } catch (cpp_redis::redis_error e) {
+                reportError(e.what());
+            }
+        }
+        pending.clear();
+    };
+
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(io_mutex);
+            io_cv.wait(lock, [] { return !io_queue.empty() || !io_running; });
+
+            if (io_queue.empty()) {
+                break;
+            }
+            tasks.swap(io_queue);
+        }
+
+        for (auto& t : tasks) {
+            if (t.job) {
+                // jobs may depend on earlier commands having been sent
+                commitPending();
+                t.job();
+                continue;
+            }
+
+            auto found = connections.find(t.clientId);
+            if (found == connections.end()) {
+                cpp_redis::reply r("ERR invalid client", cpp_redis::reply::string_type::error);
+                t.callback(r);
+                continue;
+            }
+
+            if (!found->second->prefix.empty()) {
+                prefixTask(found->second, t);
+            }
+            compressTask(found->second, t);
+
+            try {
+                dispatch(t.clientId, found->second, t.command, t.callback, t.readOnly, pending);
+            } catch (cpp_redis::redis_error e) {
+                cpp_redis::reply r(e.what(), cpp_redis::reply::string_type::error);
+                t.callback(r);
+            }
+        }
+        tasks.clear();
+
+        commitPending();
+    }
+}
+
+/*
+    Note:
+    Where the keys are in each command the prefix applies to. `first` to
+    `last` are key positions taken `step` apart, a `last` of 0 or less counts
+    back from the end of the command. `numkeys` is the position of a key count
+    followed by that many keys, as in EVAL or ZUNIONSTORE.
+*/
+struct keySpec {
+    size_t first;
+    long last;
+    size_t step;
+    size_t numkeys;
+};
+
+static std::map<std::string, keySpec> buildKeySpecs()
+{
+    std::map<std::string, keySpec> specs;
+
+    for (const char* name : { "GET", "SET", "SETNX", "SETEX", "PSETEX", "GETSET", "GETDEL", "GETEX", "APPEND",
+             "STRLEN", "INCR", "INCRBY", "INCRBYFLOAT", "DECR", "DECRBY", "GETRANGE", "SETRANGE", "GETBIT",
+             "SETBIT", "BITCOUNT", "BITPOS", "BITFIELD", "EXPIRE", "PEXPIRE", "EXPIREAT", "PEXPIREAT", "PERSIST",
+             "TTL", "PTTL", "TYPE", "DUMP", "RESTORE",
+             "HSET", "HSETNX", "HGET", "HMSET", "HMGET", "HDEL", "HEXISTS", "HGETALL", "HKEYS", "HVALS", "HLEN",
+             "HINCRBY", "HINCRBYFLOAT", "HSTRLEN", "HSCAN", "HEXPIRE", "HPEXPIRE", "HTTL", "HPTTL", "HPERSIST",
+             "LPUSH", "RPUSH", "LPUSHX", "RPUSHX", "LPOP", "RPOP", "LLEN", "LRANGE", "LINDEX", "LSET", "LREM",
+             "LTRIM", "LINSERT", "LPOS",
+             "SADD", "SREM", "SMEMBERS", "SISMEMBER", "SMISMEMBER", "SCARD", "SPOP", "SRANDMEMBER", "SSCAN",
+             "ZADD", "ZREM", "ZSCORE", "ZMSCORE", "ZINCRBY", "ZCARD", "ZCOUNT", "ZRANGE", "ZREVRANGE",
+             "ZRANGEBYSCORE", "ZREVRANGEBYSCORE", "ZRANGEBYLEX", "ZREVRANGEBYLEX", "ZRANK", "ZREVRANK",
+             "ZREMRANGEBYRANK", "ZREMRANGEBYSCORE", "ZREMRANGEBYLEX", "ZLEXCOUNT", "ZPOPMIN", "ZPOPMAX",
+             "ZRANDMEMBER", "ZSCAN",
+             "PFADD", "XADD", "XLEN", "XRANGE", "XREVRANGE", "XDEL", "XTRIM", "XACK", "XPENDING", "XCLAIM",
+             "XAUTOCLAIM", "XSETID", "GEOADD", "GEOPOS", "GEODIST", "GEOHASH", "GEOSEARCH" }) {
+        specs[name] = { 1, 1, 1, 0 };
+    }
+    for (const char* name : { "DEL", "UNLINK", "EXISTS", "TOUCH", "MGET", "WATCH", "SUNION", "SINTER", "SDIFF",
+             "SUNIONSTORE", "SINTERSTORE", "SDIFFSTORE", "PFCOUNT", "PFMERGE" }) {
+        specs[name] = { 1, 0, 1, 0 };
+    }
+    // the last argument is the timeout
+    for (const char* name : { "BLPOP", "BRPOP", "BZPOPMIN", "BZPOPMAX" }) {
+        specs[name] = { 1, -1, 1, 0 };
+    }
+    for (const char* name : { "RENAME", "RENAMENX", "SMOVE", "LMOVE", "BLMOVE", "RPOPLPUSH", "BRPOPLPUSH", "COPY",
+             "ZRANGESTORE", "GEOSEARCHSTORE" }) {
+        specs[name] = { 1, 2, 1, 0 };
+    }
+    for (const char* name : { "MSET", "MSETNX" }) {
+        specs[name] = { 1, 0, 2, 0 };
+    }
+    for (const char* name : { "XGROUP", "XINFO", "OBJECT" }) {
+        specs[name] = { 2, 2, 1, 0 };
+    }
+    specs["BITOP"] = { 2, 0, 1, 0 };
+    for (const char* name : { "EVAL", "EVALSHA", "EVAL_RO", "EVALSHA_RO", "FCALL", "FCALL_RO", "BLMPOP", "BZMPOP" }) {
+        specs[name] = { 0, 0, 0, 2 };
+    }
+    for (const char* name : { "ZUNION", "ZINTER", "ZDIFF", "ZINTERCARD", "SINTERCARD", "LMPOP", "ZMPOP" }) {
+        specs[name] = { 0, 0, 0, 1 };
+    }
+    for (const char* name : { "ZUNIONSTORE", "ZINTERSTORE", "ZDIFFSTORE" }) {
+        specs[name] = { 1, 1, 1, 2 };
+    }
+
+    return specs;
+}
+
+static const std::map<std::string, keySpec> KEY_SPECS = buildKeySpecs();
+
+/*
+    Note:
+    Prepends the client's key prefix to every key in a command, just before it
+    is written out, using the key positions above. Commands that aren't listed
+    are sent unchanged, that includes every command without keys (FLUSHDB,
+    CLIENT, SLOWLOG...) but also any keyed command missing from the table, so
+    a script sending one of those through Redis_Command has to add the prefix
+    itself. Options that name extra keys (SORT ... STORE, GEORADIUS ... STORE)
+    aren't prefixed either.
+
+    SCAN only matches prefixed keys and has the prefix stripped from its
+    results, so keys handed back to scripts can be passed straight to other
+    natives. XREAD and XREADGROUP have their stream names after STREAMS.
+*/
+void Impl::prefixTask(connection* conn, ioTask& task)
+{
+    auto& command = task.command;
+    const std::string& prefix = conn->prefix;
+    if (command.size() < 2) {
+        return;
+    }
+
+    std::string name = command[0];
+    std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+
+    if (name == "SCAN") {
+        auto match = std::find(command.begin() + 2, command.end(), "MATCH");
+        if (match != command.end() && match + 1 != command.end()) {
+            (match + 1)->insert(0, prefix);
+        } else {
+            command.push_back("MATCH");
+            command.push_back(prefix + "*");
+        }
+
+        auto callback = task.callback;
+        task.callback = [callback, prefix](cpp_redis::reply& r) {
+            if (!r.is_array() || r.as_array().size() != 2 || !r.as_array()[1].is_array()) {
+                callback(r);
+                return;
+            }
+
+            std::vector<cpp_redis::reply> keys;
+            for (auto& key : r.as_array()[1].as_array()) {
+                std::string k = key.as_string();
+                if (k.compare(0, prefix.length(), prefix) == 0) {
+                    k.erase(0, prefix.length());
+                }
+                keys.push_back(cpp_redis::reply(k, cpp_redis::reply::string_type::bulk_string));
+            }
+
+            cpp_redis::reply stripped(std::vector<cpp_redis::reply>{ r.as_array()[0], cpp_redis::reply(keys) });
+            callback(stripped);
+        };
+        return;
+    }
+
+    if (name == "XREAD" || name == "XREADGROUP") {
+        for (size_t i = 1; i < command.size(); ++i) {
+            std::string arg = command[i];
+            std::transform(arg.begin(), arg.end(), arg.begin(), ::toupper);
+            if (arg != "STREAMS") {
+                continue;
+            }
+            // the rest is the stream names followed by one ID for each
+            size_t streams = (command.size() - i - 1) / 2;
+            for (size_t j = i + 1; j <= i + streams; ++j) {
+                command[j].insert(0, prefix);
+            }
+            break;
+        }
+        return;
+    }
+
+    if (name == "MEMORY") {
+        std::string sub = command[1];
+        std::transform(sub.begin(), sub.end(), sub.begin(), ::toupper);
+        if (sub == "USAGE" && command.size() > 2) {
+            command[2].insert(0, prefix);
+        }
+        return;
+    }
+
+    auto found = KEY_SPECS.find(name);
+    if (found == KEY_SPECS.end()) {
+        return;
+    }
+    const keySpec& spec = found->second;
+
+    if (spec.first != 0) {
+        long last = spec.last > 0 ? spec.last : static_cast<long>(command.size()) - 1 + spec.last;
+        for (size_t i = spec.first; static_cast<long>(i) <= last && i < command.size(); i += spec.step) {
+            command[i].insert(0, prefix);
+        }
+    }
+
+    int keys = 0;
+    if (spec.numkeys != 0 && spec.numkeys < command.size() && parseNumber(command[spec.numkeys], keys)) {
+        for (size_t i = spec.numkeys + 1; i < command.size() && i <= spec.numkeys + static_cast<size_t>(keys); ++i) {
+            command[i].insert(0, prefix);
+        }
+    }
+}
+
+void Impl::compressTask(connection* conn, ioTask& task)
+{
+    auto& command = task.command;
+    if (command.empty()) {
+        return;
+    }
+
+    size_t value = 0;
+    if (command[0] == "SET" && command.size() >= 3) {
+        value = 2;
+    } else if (command[0] == "HSET" && command.size() == 4) {
+        value = 3;
+    }
+
+    if (value != 0 && conn->compressAbove > 0 && command[value].length() >= conn->compressAbove) {
+        std::string packed = Compress::pack(command[value]);
+        if (packed.length() < command[value].length()) {
+            command[value].swap(packed);
+        }
+        return;
+    }
+
+    if (conn->compressReads && (command[0] == "GET" || command[0] == "HGET")) {
+        auto callback = task.callback;
+        task.callback = [callback](cpp_redis::reply& r) {
+            // this runs on the network thread where an exception would end
+            // the process, a value that can't be expanded is passed on as is.
+            std::string unpacked;
+            bool expanded = false;
+            try {
+                expanded = r.get_type() == cpp_redis::reply::type::bulk_string && Compress::unpack(r.as_string(), unpacked);
+            } catch (std::exception&) {
+                expanded = false;
+            }
+            if (expanded) {
+                cpp_redis::reply value(unpacked, cpp_redis::reply::string_type::bulk_string);
+                callback(value);
+                return;
+            }
+            callback(r);
+        };
+    }
+}
+
+cpp_redis::client* Impl::openClient(std::string host, int port, std::string auth)
+{
+    cpp_redis::client* client = new cpp_redis::client();
+    client->connect(host, port);
+
+    if (auth.length() > 0) {
+        auto req = client->auth(auth);
+        client->sync_commit();
+        auto r = req.get();
+
+        if (r.is_error()) {
+            logprintf("ERROR: %s", r.error().c_str());
+            delete client;
+            return nullptr;
+        }
+    }
+
+    return client;
+}
+
+/*
+    Note:
+    Asks each Sentinel in turn for the address of the master and returns the
+    first answer as "host:port", or an empty string if none of them know it.
+    `index` is set to the Sentinel that answered.
+*/
+std::string Impl::resolveMaster(const std::vector<std::pair<std::string, int>>& sentinels, const std::string& name, size_t& index)
+{
+    for (size_t i = 0; i < sentinels.size(); ++i) {
+        cpp_redis::client sentinel;
+        try {
+            sentinel.connect(sentinels[i].first, sentinels[i].second, nullptr, 1000);
+            auto req = sentinel.send({ "SENTINEL", "get-master-addr-by-name", name });
+            sentinel.commit();
+
+            // a Sentinel that accepts the connection but never answers would
+            // otherwise hold up the I/O worker for good
+            if (req.wait_for(std::chrono::milliseconds(1000)) != std::future_status::ready) {
+                sentinel.disconnect(true);
+                continue;
+            }
+            auto r = req.get();
+            sentinel.disconnect(true);
+
+            if (r.is_array() && r.as_array().size() == 2) {
+                index = i;
+                return r.as_array()[0].as_string() + ":" + r.as_array()[1].as_string();
+            }
+        } catch (...) {
+            continue;
+        }
+    }
+
+    return "";
+}
+
+/*
+    Note:
+    Runs on the I/O worker. Replaces the connection behind a Sentinel client
+    with one to `addr`, or to whatever the Sentinels report if `addr` is empty.
+    Commands still waiting on the old master are failed by cpp_redis when it is
+    disconnected, anything queued after this job goes to the new master.
+*/
+void Impl::switchMaster(int client_id, std::string addr)
+{
+    auto found = connections.find(client_id);
+    if (found == connections.end() || found->second->sentinels.empty()) {
+        return;
+    }
+
+    connection* conn = found->second;
+    if (addr.empty()) {
+        size_t sentinel;
+        addr = resolveMaster(conn->sentinels, conn->master, sentinel);
+    }
+    if (addr.empty() || addr == conn->masterAddr) {
+        return;
+    }
+
+    size_t colon = addr.rfind(':');
+    cpp_redis::client* client;
+    try {
+        client = openClient(addr.substr(0, colon), std::atoi(addr.c_str() + colon + 1), conn->auth);
+    } catch (cpp_redis::redis_error e) {
+        reportError(e.what());
+        return;
+    }
+    if (client == nullptr) {
+        return;
+    }
+
+    cpp_redis::client* old = conn->client;
+    conn->client = client;
+    conn->masterAddr = addr;
+
+    old->disconnect(true);
+    delete old;
+
+    std::string name = conn->master;
+    complete([name, addr]() {
+        logprintf("Redis: master '%s' switched to %s", name.c_str(), addr.c_str());
+    });
+}
+
+/*
+    Note:
+    Picks the replica for a read according to the client's read policy.
+    Replicas that have lost their connection are skipped and if none are left
+    the read goes to the master instead.
+*/
+Impl::replica* Impl::pickReplica(connection* conn)
+{
+    replica* best = nullptr;
+    size_t count = conn->replicas.size();
+
+    for (size_t i = 0; i < count; ++i) {
+        replica* rep = conn->replicas[(conn->nextReplica + i) % count];
+        if (!rep->client->is_connected()) {
+            continue;
+        }
+
+        if (conn->readPolicy == READ_ROUND_ROBIN) {
+            conn->nextReplica = (conn->nextReplica + i + 1) % count;
+            return rep;
+        }
+
+        if (best == nullptr || rep->latency < best->latency) {
+            best = rep;
+        }
+    }
+
+    return best;
+}
+
+void Impl::closeConnection(connection* conn)
+{
+    for (auto rep : conn->replicas) {
+        rep->client->disconnect(true);
+        delete rep->client;
+        delete rep;
+    }
+
+    if (conn->watcher != nullptr) {
+        conn->watcher->disconnect(true);
+        delete conn->watcher;
+    }
+
+    if (conn->cluster) {
+        for (auto& node : conn->nodes) {
+            node.second->disconnect(true);
+            delete node.second;
+        }
+    } else {
+        conn->client->disconnect(true);
+        delete conn->client;
+    }
+
+    delete conn;
+}
+
+/*
+    Note:
+    Sends a command on the right connection for it and records that connection
+    in `pending` so the worker commits it once the queue has been drained.
+    Regular clients only have the one connection. Cluster clients pick the node
+    that owns the key's hash slot, and multi-key DEL, UNLINK, EXISTS and TOUCH
+    are split into one command per key so keys on different nodes don't fail
+    with CROSSSLOT. PING, DBSIZE, FLUSHDB and FLUSHALL go to every master, so
+    a PING (as used by Flush) waits for writes on all of them. The replies are
+    combined before the callback runs, counts are added together. Any other
+    command without a key goes to the seed node.
+*/
+void Impl::dispatch(int client_id, connection* conn, const std::vector<std::string>& command, const std::function<void(cpp_redis::reply&)>& callback, bool readOnly, std::set<cpp_redis::client*>& pending)
+{
+    if (readOnly && !conn->replicas.empty() && conn->readPolicy != READ_MASTER) {
+        replica* rep = pickReplica(conn);
+        if (rep != nullptr) {
+            auto start = std::chrono::steady_clock::now();
+            rep->client->send(command, [rep, start, callback](cpp_redis::reply& r) {
+                auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+                rep->latency = (rep->latency * 7 + static_cast<int>(elapsed)) / 8;
+                callback(r);
+            });
+            pending.insert(rep->client);
+            return;
+        }
+    }
+
+    if (!conn->cluster) {
+        conn->client->send(command, callback);
+        pending.insert(conn->client);
+        return;
+    }
+
+    std::string name = command.empty() ? "" : command[0];
+    std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+
+    if (command.size() > 2 && (name == "DEL" || name == "UNLINK" || name == "EXISTS" || name == "TOUCH")) {
+        auto gather = gatherReplies(command.size() - 1, callback);
+        for (size_t i = 1; i < command.size(); ++i) {
+            dispatch(client_id, conn, { command[0], command[i] }, gather, false, pending);
+        }
+        return;
+    }
+
+    if (command.size() > 2 && name == "MGET") {
+        auto gather = gatherArray(command.size() - 1, callback);
+        for (size_t i = 1; i < command.size(); ++i) {
+            size_t index = i - 1;
+            dispatch(client_id, conn, { "GET", command[i] }, [gather, index](cpp_redis::reply& r) {
+                gather(index, r);
+            }, readOnly, pending);
+        }
+        return;
+    }
+
+    if (command.size() > 3 && command.size() % 2 == 1 && name == "MSET") {
+        auto gather = gatherReplies((command.size() - 1) / 2, callback);
+        for (size_t i = 1; i + 1 < command.size(); i += 2) {
+            dispatch(client_id, conn, { "SET", command[i], command[i + 1] }, gather, false, pending);
+        }
+        return;
+    }
+
+    if (name == "PING" || name == "DBSIZE" || name == "FLUSHDB" || name == "FLUSHALL") {
+        std::set<std::string> masters(conn->slots.begin(), conn->slots.end());
+        auto gather = gatherReplies(masters.size(), callback);
+        for (auto& addr : masters) {
+            cpp_redis::client* node = nodeClient(conn, addr);
+            if (node == nullptr) {
+                cpp_redis::reply r("ERR cluster node unavailable", cpp_redis::reply::string_type::error);
+                gather(r);
+                continue;
+            }
+            sendToNode(client_id, node, command, gather, 0);
+            pending.insert(node);
+        }
+        return;
+    }
+
+    std::string key = commandKey(command);
+    cpp_redis::client* node = key.empty() ? conn->client : nodeClient(conn, conn->slots[keySlot(key)]);
+    if (node == nullptr) {
+        cpp_redis::reply r("ERR cluster node unavailable", cpp_redis::reply::string_type::error);
+        callback(r);
+        return;
+    }
+
+    sendToNode(client_id, node, command, callback, 0);
+    pending.insert(node);
+}
+
+/*
+    Note:
+    Returns a callback that collects `count` replies from a command split
+    across cluster nodes and calls `callback` once with the combined reply:
+    the first error if there was one, otherwise the sum when every reply was
+    a count and the last reply for anything else (OK, PONG).
+*/
+std::function<void(cpp_redis::reply&)> Impl::gatherReplies(size_t count, std::function<void(cpp_redis::reply&)> callback)
+{
+    struct fanout {
+        std::mutex mutex;
+        size_t remaining;
+        int64_t total;
+        bool counts;
+        std::string error;
+        cpp_redis::reply last;
+    };
+    auto state = std::make_shared<fanout>();
+    state->remaining = count;
+    state->total = 0;
+    state->counts = true;
+
+    return [state, callback](cpp_redis::reply& r) {
+        std::unique_lock<std::mutex> lock(state->mutex);
+        if (r.is_error()) {
+            if (state->error.empty()) {
+                state->error = r.error();
+            }
+        } else if (r.is_integer()) {
+            state->total += r.as_integer();
+        } else {
+            state->counts = false;
+            state->last = r;
+        }
+        if (--state->remaining > 0) {
+            return;
+        }
+        lock.unlock();
 
-    id = context_count++;
+        if (!state->error.empty()) {
+            cpp_redis::reply result(state->error, cpp_redis::reply::string_type::error);
+            callback(result);
+        } else if (state->counts) {
+            cpp_redis::reply result(state->total);
+            callback(result);
+        } else {
+            callback(state->last);
+        }
+    };
+}
 
-    sub->subscribe(channel, [id, amx, callback](const std::string& chan, const std::string& msg) {
-        message m;
-        m.clientId = id;
-        m.amx = amx;
-        m.channel = chan;
-        m.msg = msg;
-        m.callback = callback;
-
-        message_stack_mutex.lock();
-        message_stack.push(m);
-        message_stack_mutex.unlock();
-    });
+/*
+    Note:
+    Like gatherReplies but keeps every reply, in the order of `index`, and
+    calls `callback` once with them as an array. Used to put an MGET split
+    across nodes back together. Any error replaces the whole result.
+*/
+std::function<void(size_t, cpp_redis::reply&)> Impl::gatherArray(size_t count, std::function<void(cpp_redis::reply&)> callback)
+{
+    struct fanout {
+        std::mutex mutex;
+        size_t remaining;
+        std::string error;
+        std::vector<cpp_redis::reply> rows;
+    };
+    auto state = std::make_shared<fanout>();
+    state->remaining = count;
+    state->rows.resize(count);
 
-    sub->commit();
+    return [state, callback](size_t index, cpp_redis::reply& r) {
+        std::unique_lock<std::mutex> lock(state->mutex);
+        if (r.is_error() && state->error.empty()) {
+            state->error = r.error();
+        }
+        state->rows[index] = r;
+        if (--state->remaining > 0) {
+            return;
+        }
+        lock.unlock();
 
-    return 0;
+        if (!state->error.empty()) {
+            cpp_redis::reply result(state->error, cpp_redis::reply::string_type::error);
+            callback(result);
+        } else {
+            cpp_redis::reply result(state->rows);
+            callback(result);
+        }
+    };
 }
 
-int Impl::Unsubscribe(int client_id)
+/*
+    Note:
+    Sends a command to a cluster node and watches the reply for redirects.
+    Redirects are handed back to the I/O worker as a job because only the
+    worker may touch the connections, the callback itself runs on the network
+    thread.
+*/
+void Impl::sendToNode(int client_id, cpp_redis::client* node, const std::vector<std::string>& command, const std::function<void(cpp_redis::reply&)>& callback, int redirects)
 {
-    clientData cd;
+    node->send(command, [client_id, command, callback, redirects](cpp_redis::reply& r) {
+        if (r.is_error() && redirects < 5) {
+            std::istringstream iss(r.error());
+            std::string kind;
+            int slot = -1;
+            std::string addr;
+            iss >> kind >> slot >> addr;
 
-    int err = clientDataFromID(client_id, cd);
-    if (err) {
-        return 1;
+            if ((kind == "MOVED" || kind == "ASK") && slot >= 0 && slot < 16384 && !addr.empty()) {
+                bool ask = kind == "ASK";
+                enqueue(ioTask{ client_id, {}, nullptr, [=]() {
+                    redirect(client_id, command, callback, redirects + 1, ask, slot, addr);
+                } });
+                return;
+            }
+        }
+
+        callback(r);
+    });
+}
+
+void Impl::redirect(int client_id, std::vector<std::string> command, std::function<void(cpp_redis::reply&)> callback, int redirects, bool ask, int slot, std::string addr)
+{
+    auto found = connections.find(client_id);
+    if (found == connections.end()) {
+        cpp_redis::reply r("ERR invalid client", cpp_redis::reply::string_type::error);
+        callback(r);
+        return;
     }
 
-    cd.subscriber->unsubscribe(cd.channel);
-    cd.subscriber->commit();
+    connection* conn = found->second;
+    if (!ask) {
+        conn->slots[slot] = addr;
+    }
 
-    clients.erase(client_id);
+    cpp_redis::client* node = nodeClient(conn, addr);
+    if (node == nullptr) {
+        cpp_redis::reply r("ERR cluster node unavailable", cpp_redis::reply::string_type::error);
+        callback(r);
+        return;
+    }
 
-    return 0;
+    try {
+        if (ask) {
+            node->send({ "ASKING" }, [](cpp_redis::reply&) {});
+        }
+        sendToNode(client_id, node, command, callback, redirects);
+        node->commit();
+    } catch (cpp_redis::redis_error e) {
+        cpp_redis::reply r(e.what(), cpp_redis::reply::string_type::error);
+        callback(r);
+    }
 }
 
-int Impl::Publish(int client_id, std::string channel, std::string data)
+/*
+    Note:
+    Returns the connection to a cluster node, opening it the first time the
+    node is used. Nodes are identified by their "host:port" address as it
+    appears in CLUSTER SLOTS and MOVED replies.
+*/
+cpp_redis::client* Impl::nodeClient(connection* conn, const std::string& addr)
 {
+    auto found = conn->nodes.find(addr);
+    if (found != conn->nodes.end()) {
+        return found->second;
+    }
+
+    size_t colon = addr.rfind(':');
+    if (colon == std::string::npos) {
+        return nullptr;
+    }
+
     cpp_redis::client* client;
-    int err = clientFromID(client_id, client);
-    if (err) {
-        return 1;
+    try {
+        client = openClient(addr.substr(0, colon), std::atoi(addr.c_str() + colon + 1), conn->auth);
+    } catch (cpp_redis::redis_error e) {
+        reportError(e.what());
+        return nullptr;
+    }
+
+    if (client != nullptr) {
+        conn->nodes[addr] = client;
     }
 
-    auto req = client->publish(channel, data);
-    client->sync_commit();
+    return client;
+}
+
+/*
+    Note:
+    Reads the slot map from the seed node. Each entry of the reply is
+    [start, end, [host, port, ...], replicas...], only the master is used.
+*/
+int Impl::loadSlots(connection* conn, std::string host)
+{
+    auto req = conn->client->send({ "CLUSTER", "SLOTS" });
+    conn->client->sync_commit();
     auto r = req.get();
+
     if (r.is_error()) {
         logprintf("ERROR: %s", r.error().c_str());
+    }
+
+    return applySlots(conn, host, r);
+}
+
+/*
+    Note:
+    Runs on the I/O worker. Asks for the slot map without waiting for it, so
+    the other clients' commands keep flowing while a cluster reshuffles. The
+    reply is applied by a job back on the worker, which then runs `then`
+    whether or not the refresh worked.
+*/
+void Impl::refreshSlots(int client_id, std::string host, std::function<void()> then)
+{
+    auto found = connections.find(client_id);
+    if (found == connections.end() || !found->second->cluster) {
+        then();
+        return;
+    }
+
+    try {
+        found->second->client->send({ "CLUSTER", "SLOTS" }, [client_id, host, then](cpp_redis::reply& r) {
+            enqueue(ioTask{ -1, {}, nullptr, [client_id, host, then, r]() mutable {
+                auto found = connections.find(client_id);
+                if (found != connections.end() && applySlots(found->second, host, r) == 2) {
+                    reportError(r.error());
+                }
+                then();
+            } });
+        });
+        found->second->client->commit();
+    } catch (cpp_redis::redis_error e) {
+        reportError(e.what());
+        then();
+    }
+}
+
+int Impl::applySlots(connection* conn, std::string host, cpp_redis::reply& r)
+{
+    if (r.is_error()) {
         return 2;
+    } else if (!r.is_array()) {
+        return 4;
+    }
+
+    for (auto& range : r.as_array()) {
+        auto& fields = range.as_array();
+        if (fields.size() < 3) {
+            continue;
+        }
+
+        int start = static_cast<int>(fields[0].as_integer());
+        int end = static_cast<int>(fields[1].as_integer());
+        auto& master = fields[2].as_array();
+
+        std::string ip = master[0].as_string();
+        std::string addr = (ip.empty() ? host : ip) + ":" + std::to_string(master[1].as_integer());
+
+        for (int slot = start; slot <= end && slot < 16384; ++slot) {
+            conn->slots[slot] = addr;
+        }
     }
 
     return 0;
 }
 
-void Impl::amx_tick()
+/*
+    Note:
+    Works out which argument of a command is the key used for routing. Almost
+    every command takes its key first, the exceptions are listed here.
+    Commands with no key return an empty string and go to the seed node.
+*/
+std::string Impl::commandKey(const std::vector<std::string>& command)
 {
-    if (message_stack_mutex.try_lock()) {
-        message m;
-        int error = 0;
-        int amx_idx = -1;
-        cell amx_addr;
-        cell amx_ret;
-        cell* phys_addr;
+    if (command.size() < 2) {
+        return "";
+    }
 
-        while (!message_stack.empty()) {
-            m = message_stack.top();
+    std::string name = command[0];
+    std::transform(name.begin(), name.end(), name.begin(), ::toupper);
 
-            AMX* amx = m.amx;
+    if (name == "PING" || name == "SCAN" || name == "INFO" || name == "CLUSTER" || name == "AUTH" || name == "SELECT") {
+        return "";
+    } else if (name == "EVAL" || name == "EVALSHA") {
+        return command.size() > 3 && command[2] != "0" ? command[3] : "";
+    } else if (name == "XGROUP" || name == "XINFO" || name == "OBJECT") {
+        return command.size() > 2 ? command[2] : "";
+    }
 
-            error = amx_FindPublic(amx, m.callback.c_str(), &amx_idx);
+    return command[1];
+}
 
-            if (error == AMX_ERR_NONE) {
-                /*
-				Note:
-				This is the part that calls the Pawn callback!
-				*/
-                amx_Push(amx, m.msg.length());
-                amx_PushString(amx, &amx_addr, &phys_addr, m.msg.c_str(), 0, 0);
-                amx_Push(amx, m.clientId);
+/*
+    Note:
+    Hash slot of a key, CRC16 (XMODEM) of the key modulo 16384. If the key
+    contains a non-empty {hash tag} only the tag is hashed so related keys can
+    be kept on the same node.
+*/
+int Impl::keySlot(const std::string& key)
+{
+    size_t start = key.find('{');
+    size_t length = key.length();
+    const char* data = key.data();
 
-                amx_Exec(amx, &amx_ret, amx_idx);
-                amx_Release(amx, amx_addr);
+    if (start != std::string::npos) {
+        size_t end = key.find('}', start + 1);
+        if (end != std::string::npos && end != start + 1) {
+            data += start + 1;
+            length = end - start - 1;
+        }
+    }
 
-                if (amx_ret > 0) {
-                    // todo: something clever with the return value...
-                    // logprintf("return from amx was %d", amx_ret);
-                }
-            } else {
-                logprintf("ERROR: Redis amx_FindPublic returned %d for callback '%s' channel '%s'",
-                    error,
-                    m.callback.c_str(),
-                    m.channel.c_str());
+    uint16_t crc = 0;
+    for (size_t i = 0; i < length; ++i) {
+        crc ^= static_cast<uint16_t>(static_cast<unsigned char>(data[i])) << 8;
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = crc & 0x8000 ? static_cast<uint16_t>((crc << 1) ^ 0x1021) : static_cast<uint16_t>(crc << 1);
+        }
+    }
+
+    return crc % 16384;
+}
+
+void Impl::io_tick()
+{
+    flushPublishes();
+    reapConsumers(false);
+
+    std::vector<int> retries;
+    {
+        std::lock_guard<std::mutex> lock(shard_mutex);
+        auto now = std::chrono::steady_clock::now();
+        for (auto it = shard_retries.begin(); it != shard_retries.end();) {
+            if (it->second > now) {
+                ++it;
+                continue;
+            }
+            retries.push_back(it->first);
+            it = shard_retries.erase(it);
+        }
+    }
+    for (int sub_id : retries) {
+        enqueue(ioTask{ -1, {}, nullptr, [sub_id]() {
+            auto found = shards.find(sub_id);
+            if (found != shards.end() && found->second->link == nullptr) {
+                shardMoved(sub_id, found->second->linkId);
             }
+        } });
+    }
+
+    std::deque<std::function<void()>> done;
+    {
+        std::lock_guard<std::mutex> lock(completions_mutex);
+        done.swap(completions);
+    }
+
+    for (auto& fn : done) {
+        fn();
+    }
+}
+
+void Impl::enqueue(ioTask task)
+{
+    if (!task.callback) {
+        task.callback = logReply;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(io_mutex);
+        io_queue.push_back(std::move(task));
+    }
+    io_cv.notify_one();
+}
 
-            message_stack.pop();
+void Impl::enqueue(std::vector<ioTask> tasks)
+{
+    {
+        std::lock_guard<std::mutex> lock(io_mutex);
+        for (auto& task : tasks) {
+            if (!task.callback) {
+                task.callback = logReply;
+            }
+            io_queue.push_back(std::move(task));
         }
-        message_stack_mutex.unlock();
     }
+    io_cv.notify_one();
+}
 
-    return;
+/*
+    Note:
+    Runs `job` on the I/O worker and blocks until it has finished. Exceptions
+    thrown by the job are rethrown here so natives can catch them as usual.
+*/
+void Impl::runJob(std::function<void()> job)
+{
+    auto done = std::make_shared<std::promise<void>>();
+    auto future = done->get_future();
+
+    enqueue(ioTask{ -1, {}, nullptr, [job, done]() {
+        try {
+            job();
+            done->set_value();
+        } catch (...) {
+            done->set_exception(std::current_exception());
+        }
+    } });
+
+    future.get();
 }
 
-int Impl::clientFromID(int client_id, cpp_redis::client*& client)
+std::future<cpp_redis::reply> Impl::request(int client_id, std::vector<std::string> command, bool readOnly)
 {
-    try {
-        auto cd = clients.at(client_id);
-        client = cd.client;
-    } catch (...) {
+    auto result = std::make_shared<std::promise<cpp_redis::reply>>();
+
+    enqueue(ioTask{ client_id, std::move(command), [result](cpp_redis::reply& r) {
+        result->set_value(r);
+    }, nullptr, readOnly });
+
+    return result->get_future();
+}
+
+void Impl::post(int client_id, std::vector<std::string> command)
+{
+    ++write_epoch;
+    enqueue(ioTask{ client_id, std::move(command), logReply, nullptr });
+}
+
+/*
+    Note:
+    Sends a read, sharing the request with an identical read that is already
+    waiting on a reply. Reads are only shared if no write has been queued
+    since the first one was sent, otherwise a read made after a write could be
+    handed a value from before it.
+*/
+void Impl::coalesce(int client_id, std::vector<std::string> command, bool readOnly, std::function<void(cpp_redis::reply&)> callback)
+{
+    std::string key = std::to_string(client_id) + (readOnly ? 'r' : 'w') + std::to_string(write_epoch);
+    for (auto& arg : command) {
+        key += '\0';
+        key += arg;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(inflight_mutex);
+        auto found = inflight.find(key);
+        if (found != inflight.end()) {
+            found->second.push_back(std::move(callback));
+            return;
+        }
+        inflight[key].push_back(std::move(callback));
+    }
+
+    enqueue(ioTask{ client_id, std::move(command), [key](cpp_redis::reply& r) {
+        std::vector<std::function<void(cpp_redis::reply&)>> waiters;
+        {
+            std::lock_guard<std::mutex> lock(inflight_mutex);
+            auto found = inflight.find(key);
+            if (found == inflight.end()) {
+                return;
+            }
+            waiters.swap(found->second);
+            inflight.erase(found);
+        }
+
+        for (auto& waiter : waiters) {
+            waiter(r);
+        }
+    }, nullptr, readOnly });
+}
+
+std::future<cpp_redis::reply> Impl::read(int client_id, std::vector<std::string> command, bool readOnly)
+{
+    auto result = std::make_shared<std::promise<cpp_redis::reply>>();
+
+    coalesce(client_id, std::move(command), readOnly, [result](cpp_redis::reply& r) {
+        result->set_value(r);
+    });
+
+    return result->get_future();
+}
+
+void Impl::complete(std::function<void()> fn)
+{
+    std::lock_guard<std::mutex> lock(completions_mutex);
+    completions.push_back(std::move(fn));
+}
+
+void Impl::reportError(std::string error)
+{
+    complete([error]() {
+        logprintf("ERROR: %s", error.c_str());
+    });
+}
+
+void Impl::logReply(cpp_redis::reply& r)
+{
+    if (r.is_error()) {
+        reportError(r.error());
+    }
+}
+
+/*
+    Note:
+    Pins the I/O worker to a single CPU core so it doesn't compete with the
+    server's main thread.
+*/
+int Impl::SetWorkerAffinity(int cpu)
+{
+    if (cpu < 0) {
+        return 1;
+    }
+
+#if defined WIN32 || defined _WIN32
+    if (cpu >= static_cast<int>(sizeof(DWORD_PTR) * 8)) {
+        return 1;
+    }
+    if (SetThreadAffinityMask(io_thread.native_handle(), DWORD_PTR(1) << cpu) == 0) {
+        return 2;
+    }
+#else
+    if (cpu >= CPU_SETSIZE) {
         return 1;
     }
 
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(io_thread.native_handle(), sizeof(set), &set) != 0) {
+        return 2;
+    }
+#endif
+
     return 0;
 }
 
+bool Impl::isClient(int client_id)
+{
+    auto found = clients.find(client_id);
+    return found != clients.end() && found->second.isClient;
+}
+
 int Impl::clientDataFromID(int client_id, clientData& cd)
 {
     try {
@@ -552,3 +4225,203 @@ std::vector<std::string> Impl::split(const std::string s)
 
     return result;
 }
+
+/*
+    Note:
+    Number formatting and parsing used by every numeric native. These work on
+    a stack buffer and don't depend on the C locale, so a server that has
+    changed LC_NUMERIC still writes "1.5" and not "1,5". Floats go through
+    printf with a "C" locale object of their own, passed to _snprintf_l on
+    Windows and made current for the call with uselocale elsewhere, so the
+    process locale is never changed. Floats are written
+    with enough digits to read back the exact same value. Parsing requires the
+    whole string to be a number, so callers can report non-numeric data as an
+    error instead of treating it as zero.
+*/
+std::string Impl::formatNumber(long long value)
+{
+    char buf[24];
+    char* end = buf + sizeof(buf);
+    char* p = end;
+    unsigned long long n = value < 0 ? 0ULL - static_cast<unsigned long long>(value) : static_cast<unsigned long long>(value);
+
+    do {
+        *--p = static_cast<char>('0' + n % 10);
+        n /= 10;
+    } while (n != 0);
+
+    if (value < 0) {
+        *--p = '-';
+    }
+
+    return std::string(p, end);
+}
+
+std::string Impl::formatNumber(int value)
+{
+    return formatNumber(static_cast<long long>(value));
+}
+
+std::string Impl::formatNumber(float value)
+{
+    return formatNumber(static_cast<double>(value), 9);
+}
+
+std::string Impl::formatNumber(double value, int precision)
+{
+    char buf[32];
+#if defined WIN32 || defined _WIN32
+    static _locale_t c_locale = _create_locale(LC_NUMERIC, "C");
+    int len = _snprintf_l(buf, sizeof(buf), "%.*g", c_locale, precision, value);
+#else
+    static locale_t c_locale = newlocale(LC_NUMERIC_MASK, "C", static_cast<locale_t>(0));
+    locale_t previous = uselocale(c_locale);
+    int len = snprintf(buf, sizeof(buf), "%.*g", precision, value);
+    uselocale(previous);
+#endif
+    if (len <= 0) {
+        return "0";
+    }
+    if (len >= static_cast<int>(sizeof(buf))) {
+        len = sizeof(buf) - 1;
+    }
+
+    return std::string(buf, len);
+}
+
+bool Impl::parseNumber(const std::string& str, int& value)
+{
+    const char* p = str.c_str();
+    const char* end = p + str.length();
+    bool negative = false;
+
+    if (p != end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        ++p;
+    }
+    if (p == end) {
+        return false;
+    }
+
+    long long n = 0;
+    for (; p != end; ++p) {
+        if (*p < '0' || *p > '9') {
+            return false;
+        }
+        n = n * 10 + (*p - '0');
+        if (n > 2147483648LL) {
+            return false;
+        }
+    }
+
+    if (negative) {
+        n = -n;
+    } else if (n > 2147483647LL) {
+        return false;
+    }
+
+    value = static_cast<int>(n);
+    return true;
+}
+
+bool Impl::parseNumber(const std::string& str, float& value)
+{
+    const char* p = str.c_str();
+    const char* end = p + str.length();
+    bool negative = false;
+
+    if (p != end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        ++p;
+    }
+
+    // Redis writes infinite scores as "inf"
+    if (end - p == 3 && (p[0] == 'i' || p[0] == 'I') && (p[1] == 'n' || p[1] == 'N') && (p[2] == 'f' || p[2] == 'F')) {
+        value = negative ? -HUGE_VALF : HUGE_VALF;
+        return true;
+    }
+
+    unsigned long long mantissa = 0;
+    int exponent = 0;
+    int digits = 0;
+
+    for (; p != end && *p >= '0' && *p <= '9'; ++p, ++digits) {
+        if (mantissa < 100000000000000000ULL) {
+            mantissa = mantissa * 10 + (*p - '0');
+        } else {
+            ++exponent;
+        }
+    }
+    if (p != end && *p == '.') {
+        ++p;
+        for (; p != end && *p >= '0' && *p <= '9'; ++p, ++digits) {
+            if (mantissa < 100000000000000000ULL) {
+                mantissa = mantissa * 10 + (*p - '0');
+                --exponent;
+            }
+        }
+    }
+    if (digits == 0) {
+        return false;
+    }
+
+    if (p != end && (*p == 'e' || *p == 'E')) {
+        ++p;
+        bool negativeExp = false;
+        if (p != end && (*p == '-' || *p == '+')) {
+            negativeExp = *p == '-';
+            ++p;
+        }
+        if (p == end) {
+            return false;
+        }
+        int e = 0;
+        for (; p != end && *p >= '0' && *p <= '9'; ++p) {
+            if (e < 10000) {
+                e = e * 10 + (*p - '0');
+            }
+        }
+        exponent += negativeExp ? -e : e;
+    }
+    if (p != end) {
+        return false;
+    }
+
+    double result = static_cast<double>(mantissa);
+    if (exponent < 0) {
+        result /= std::pow(10.0, -exponent);
+    } else if (exponent > 0) {
+        result *= std::pow(10.0, exponent);
+    }
+
+    value = static_cast<float>(negative ? -result : result);
+    return true;
+}
+
+std::string Impl::packCells(const std::vector<int>& data)
+{
+    std::string out(data.size() * 4, '\0');
+    for (size_t i = 0; i < data.size(); ++i) {
+        unsigned int v = static_cast<unsigned int>(data[i]);
+        out[i * 4] = static_cast<char>(v & 0xFF);
+        out[i * 4 + 1] = static_cast<char>((v >> 8) & 0xFF);
+        out[i * 4 + 2] = static_cast<char>((v >> 16) & 0xFF);
+        out[i * 4 + 3] = static_cast<char>((v >> 24) & 0xFF);
+    }
+    return out;
+}
+
+bool Impl::unpackCells(const std::string& raw, std::vector<int>& data)
+{
+    if (raw.length() % 4 != 0) {
+        return false;
+    }
+
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(raw.data());
+    data.resize(raw.length() / 4);
+    for (size_t i = 0; i < data.size(); ++i, p += 4) {
+        unsigned int v = p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<unsigned int>(p[3]) << 24);
+        data[i] = static_cast<int>(v);
+    }
+    return true;
+}
@@ -29,15 +29,27 @@
 #ifndef PAWN_REDIS_IMPL_H
 #define PAWN_REDIS_IMPL_H
 
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <future>
 #include <iterator>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <random>
+#include <set>
 #include <sstream>
 #include <stack>
 #include <string>
 #include <thread>
 #include <vector>
 #include <iomanip>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <condition_variable>
 
 #include <amx/amx2.h>
 #include <cpp_redis/cpp_redis>
@@ -47,14 +59,190 @@
 
 namespace Impl {
 
-struct clientData {
+struct streamEntry {
+    std::string id;
+    std::string data;
+};
+
+// shared by every message from the same subscription or consumer
+struct messageSource {
+    std::string channel;
+    std::string callback;
+};
+
+struct streamConsumer {
+    cpp_redis::client* client;
+    std::thread thread;
+    std::atomic<bool> running;
+    std::atomic<bool> finished;
+    AMX* amx;
+    unsigned int generation;
+    int id;
+    int batch;
+    std::string stream;
+    std::string group;
+    std::string consumer;
+    std::string callback;
+    std::shared_ptr<const messageSource> source;
+    std::vector<std::string> acks;
+    std::mutex acks_mutex;
+};
+
+struct scanIterator {
+    int clientId;
+    std::vector<std::string> command;
+    std::vector<std::string> page;
+    size_t pos;
+    bool done;
+    std::future<cpp_redis::reply> next;
+};
+
+struct pendingWrite {
+    bool hasValue = false;
+    std::string value;
+    long long incr = 0;
+    double incrFloat = 0.0;
+};
+
+struct writeCache {
+    int clientId;
+    std::thread thread;
+    std::atomic<bool> running;
+    std::atomic<int> interval;
+    std::map<std::pair<std::string, std::string>, pendingWrite> dirty;
+    std::mutex mutex;
+    std::condition_variable cv;
+};
+
+struct distLock {
+    AMX* amx;
+    unsigned int generation;
+    int clientId;
+    std::string name;
+    std::string token;
+    int lease;
+    std::atomic<bool> held;
+    std::chrono::steady_clock::time_point renewAt;
+};
+
+struct lockRequest {
+    AMX* amx;
+    unsigned int generation;
+    int clientId;
+    std::string name;
+    std::string token;
+    int lease;
+    std::string callback;
+    std::chrono::steady_clock::time_point deadline;
+    std::chrono::steady_clock::time_point retryAt;
+    bool waiting;
+    bool cancelled;
+};
+
+struct ioTask {
+    int clientId;
+    std::vector<std::string> command;
+    std::function<void(cpp_redis::reply&)> callback;
+    std::function<void()> job;
+    bool readOnly = false;
+};
+
+enum messagePriority {
+    PRIORITY_HIGH,
+    PRIORITY_NORMAL,
+    PRIORITY_LOW,
+    MESSAGE_PRIORITIES
+};
+
+enum setFlags {
+    SET_NX = 1,
+    SET_XX = 2
+};
+
+enum filterType {
+    FILTER_EXCLUDE_PREFIX,
+    FILTER_CONTAINS,
+    FILTER_FIELD
+};
+
+enum keyspaceMode {
+    KEYSPACE_EVENTS,
+    KEYSPACE_KEYS
+};
+
+enum readPolicy {
+    READ_MASTER,
+    READ_ROUND_ROBIN,
+    READ_LEAST_LATENCY
+};
+
+struct replica {
     cpp_redis::client* client;
+    std::atomic<int> latency;
+};
+
+struct connection {
+    cpp_redis::client* client = nullptr;
+    std::string auth;
+    bool cluster = false;
+    std::map<std::string, cpp_redis::client*> nodes;
+    std::vector<std::string> slots;
+    std::vector<std::pair<std::string, int>> sentinels;
+    std::string master;
+    std::string masterAddr;
+    cpp_redis::subscriber* watcher = nullptr;
+    std::vector<replica*> replicas;
+    size_t nextReplica = 0;
+    int readPolicy = READ_MASTER;
+    size_t compressAbove = 0;
+    bool compressReads = false;
+    std::string prefix;
+};
+
+struct messageFilter {
+    int type;
+    std::string value;
+    int field;
+    std::string delimiter;
+};
+
+struct filterSet {
+    std::mutex mutex;
+    std::vector<messageFilter> filters;
+    std::atomic<long long> dropped{ 0 };
+};
+
+// upper bounds in milliseconds of the queue latency buckets, the last bucket
+// takes everything slower
+const int LATENCY_BUCKETS = 6;
+const long long LATENCY_LIMITS[LATENCY_BUCKETS - 1] = { 1, 5, 20, 100, 500 };
+
+struct queueStats {
+    long long depth = 0;
+    long long peak = 0;
+    long long received = 0;
+    long long dispatched = 0;
+    long long conflated = 0;
+    long long discarded = 0;
+    long long latency[LATENCY_BUCKETS] = {};
+    long long maxLatency = 0;
+};
+
+struct clientData {
+    bool isClient = false;
+    bool cluster = false;
     std::string host;
-    int port;
+    int port = 0;
     std::string auth;
 	std::string channel;
-    bool isPubSub;
-    cpp_redis::subscriber* subscriber;
+    bool isPubSub = false;
+    cpp_redis::subscriber* subscriber = nullptr;
+    bool pattern = false;
+    bool sharded = false;
+    std::shared_ptr<filterSet> filters;
+    AMX* amx = nullptr;
+    streamConsumer* consumer = nullptr;
+    writeCache* cache = nullptr;
 };
 
 struct subscription {
@@ -64,45 +252,261 @@ struct subscription {
 
 struct message {
 	int clientId;
-    std::string channel;
+    std::shared_ptr<const messageSource> source;
     std::string msg;
-    std::string callback;
 	AMX* amx;
+    unsigned int generation;
+    int priority = PRIORITY_NORMAL;
+    bool batched = false;
+    bool conflated = false;
+    std::string conflateKey;
+    bool keyspace = false;
+    std::string event;
+    std::chrono::steady_clock::time_point queued;
+    std::vector<streamEntry> entries;
 };
 
-int Connect(std::string hostname, int port, std::string auth, int& id);
+struct subscribeOptions {
+    int priority = PRIORITY_NORMAL;
+    bool batched = false;
+    bool conflate = false;
+    std::string delimiter;
+    bool keyspace = false;
+    bool keyChannels = false;
+    std::string keyEvents;
+    std::string keyPrefix;
+    std::shared_ptr<filterSet> filters;
+};
+
+struct shardSubscription {
+    int id;
+    int clientId;
+    std::string channel;
+    std::string addr;
+    std::string fallback;
+    cpp_redis::network::redis_connection* link = nullptr;
+    unsigned int linkId = 0;
+    AMX* amx;
+    unsigned int generation;
+    std::shared_ptr<const messageSource> source;
+    subscribeOptions options;
+    std::atomic<bool> closing;
+    bool retrying = false;
+};
+
+struct messageBatch {
+    int id;
+    std::vector<std::string> messages;
+    size_t pos;
+};
+
+int Connect(std::string hostname, int port, std::string auth, int& id, std::string prefix = "");
 int Disconnect(int client_id);
+int ConnectCluster(std::string host, int port, std::string auth, int& id, std::string prefix = "");
+int ConnectSentinel(std::string sentinels, std::string name, std::string auth, int& id, std::string prefix = "");
+int AddReplica(int client_id, std::string host, int port);
+int SetReadPolicy(int client_id, int policy);
+int SetCompression(int client_id, int threshold);
 
 int Command(int client_id, std::string command);
-int Exists(int client_id, std::string key);
-int SetString(int client_id, std::string key, std::string value);
-int GetString(int client_id, std::string key, std::string& value);
-int SetInt(int client_id, std::string key, int value);
-int GetInt(int client_id, std::string key, int& value);
-int SetFloat(int client_id, std::string key, float value);
-int GetFloat(int client_id, std::string key, float& value);
-
-int SetHString(int client_id, std::string key, std::string field, std::string value);
-int GetHString(int client_id, std::string key, std::string field, std::string& value);
-int HExists(int client_id, std::string key, std::string field);
+int Exists(int client_id, std::string key, bool fresh = false);
+int SetString(int client_id, std::string key, std::string value, int ttl = 0, int flags = 0);
+int GetString(int client_id, std::string key, std::string& value, bool fresh = false);
+int GetStringAsync(AMX* amx, int client_id, std::string key, std::string callback);
+int GetHStringAsync(AMX* amx, int client_id, std::string key, std::string field, std::string callback);
+std::string readValue(cpp_redis::reply& r, int& error);
+int SetInt(int client_id, std::string key, int value, int ttl = 0, int flags = 0);
+int GetInt(int client_id, std::string key, int& value, bool fresh = false);
+int SetFloat(int client_id, std::string key, float value, int ttl = 0, int flags = 0);
+int GetFloat(int client_id, std::string key, float& value, bool fresh = false);
+int SetArray(int client_id, std::string key, const std::vector<int>& data, int ttl = 0, int flags = 0);
+int GetArray(int client_id, std::string key, std::vector<int>& data, bool fresh = false);
+
+int SetHString(int client_id, std::string key, std::string field, std::string value, int ttl = 0);
+int GetHString(int client_id, std::string key, std::string field, std::string& value, bool fresh = false);
+int HExists(int client_id, std::string key, std::string field, bool fresh = false);
 int HIncrBy(int client_id, std::string key, std::string field, int incr);
 int HIncrByFloat(int client_id, std::string key, std::string field, float incr);
 int HDel(int client_id, std::string key, std::string field);
+int SetHInt(int client_id, std::string key, std::string field, int value, int ttl = 0);
+int GetHInt(int client_id, std::string key, std::string field, int& value, bool fresh = false);
+int SetHFloat(int client_id, std::string key, std::string field, float value, int ttl = 0);
+int GetHFloat(int client_id, std::string key, std::string field, float& value, bool fresh = false);
+int SetHArray(int client_id, std::string key, std::string field, const std::vector<int>& data, int ttl = 0);
+int GetHArray(int client_id, std::string key, std::string field, std::vector<int>& data, bool fresh = false);
+
+int ZAdd(int client_id, std::string key, std::string member, float score);
+int ZIncrBy(int client_id, std::string key, std::string member, float incr, float& score);
+int ZRem(int client_id, std::string key, std::string member);
+int ZScore(int client_id, std::string key, std::string member, float& score, bool fresh = false);
+int ZRange(int client_id, std::string key, int start, int stop, bool reverse, std::vector<std::pair<std::string, float>>& result, bool fresh = false);
+int ZRankBatch(int client_id, std::string key, const std::vector<std::string>& members, bool reverse, std::vector<int>& ranks, bool fresh = false);
 
-int Subscribe(AMX* amx, std::string host, int port, std::string auth, std::string channel, std::string callback, int& id);
+int Subscribe(AMX* amx, std::string host, int port, std::string auth, std::string channel, std::string callback, int& id, subscribeOptions options = subscribeOptions());
+int SubscribeKeyspace(AMX* amx, std::string host, int port, std::string auth, int db, std::string events, std::string prefix, std::string callback, int& id, subscribeOptions options = subscribeOptions(), int mode = KEYSPACE_EVENTS);
+int BatchNext(int batch_id, std::string& msg);
 int Unsubscribe(int client_id);
-int Publish(int client_id, std::string channel, std::string message);
+int Publish(int client_id, std::string channel, std::string message, bool sharded = false);
+int PublishAsync(int client_id, std::string channel, std::string message, bool sharded = false);
+int SSubscribe(AMX* amx, int client_id, std::string channel, std::string callback, int& id, subscribeOptions options = subscribeOptions());
+int AddFilter(int client_id, messageFilter filter);
+int ClearFilters(int client_id);
+bool acceptMessage(const subscribeOptions& options, const std::string& msg);
+bool matchMessage(const subscribeOptions& options, const std::string& msg);
+message subscriptionMessage(int client_id, AMX* amx, unsigned int generation, const subscribeOptions& options, const std::shared_ptr<const messageSource>& source, const std::string& chan, const std::string& msg);
+int shardConnect(shardSubscription* shard);
+void shardReply(shardSubscription* shard, unsigned int link_id, cpp_redis::reply& r);
+void shardMoved(int sub_id, unsigned int link_id);
+void shardReconnect(int sub_id, unsigned int link_id);
+void shardLost(shardSubscription* shard, unsigned int link_id);
+int PublishMulti(int client_id, const std::vector<std::string>& channels, std::string message);
+void flushPublishes();
 
-int clientFromID(int client_id, cpp_redis::client*& client);
+int XAdd(int client_id, std::string stream, std::string data, int maxlen, std::string& id);
+int XConsume(AMX* amx, std::string host, int port, std::string auth, std::string stream, std::string group, std::string consumer, std::string callback, int batch, int& id);
+int XStop(int client_id);
+void streamWorker(streamConsumer* sc);
+void reapConsumers(bool wait);
+
+int ScanBegin(int client_id, std::string command, std::string key, std::string pattern, int count, int& id);
+int ScanNext(int iter_id, std::string& item, std::string& value);
+int ScanEnd(int iter_id);
+void scanFetch(scanIterator& it, std::string cursor);
+
+int LockAcquire(AMX* amx, int client_id, std::string name, int lease, int& id);
+int LockAcquireAsync(AMX* amx, int client_id, std::string name, int lease, int timeout, std::string callback);
+int LockRelease(int lock_id);
+int LockHeld(int lock_id);
+void dropLocks(int client_id);
+void dropLocks(AMX* amx, unsigned int generation);
+int addLock(AMX* amx, unsigned int generation, int client_id, std::string name, std::string token, int lease);
+std::string lockToken();
+void lockDeliver(lockRequest* req, int lock_id, int error);
+void lockWorker();
+
+int SetWriteBehind(int client_id, int interval);
+int Flush(int client_id);
+writeCache* cacheFromID(int client_id);
+bool cacheLookup(writeCache* cache, std::string key, std::string field, std::string& value, bool& flushed);
+void cacheCommit(writeCache* cache);
+void cacheWorker(writeCache* cache);
+
+void ioStart();
+void ioStop();
+void ioWorker();
+void io_tick();
+void enqueue(ioTask task);
+void enqueue(std::vector<ioTask> tasks);
+void runJob(std::function<void()> job);
+std::future<cpp_redis::reply> request(int client_id, std::vector<std::string> command, bool readOnly = false);
+void post(int client_id, std::vector<std::string> command);
+void coalesce(int client_id, std::vector<std::string> command, bool readOnly, std::function<void(cpp_redis::reply&)> callback);
+std::future<cpp_redis::reply> read(int client_id, std::vector<std::string> command, bool readOnly);
+void complete(std::function<void()> fn);
+void reportError(std::string error);
+void logReply(cpp_redis::reply& r);
+int SetWorkerAffinity(int cpu);
+
+cpp_redis::client* openClient(std::string host, int port, std::string auth);
+void closeConnection(connection* conn);
+std::string resolveMaster(const std::vector<std::pair<std::string, int>>& sentinels, const std::string& name, size_t& index);
+void switchMaster(int client_id, std::string addr);
+void prefixTask(connection* conn, ioTask& task);
+void compressTask(connection* conn, ioTask& task);
+void dispatch(int client_id, connection* conn, const std::vector<std::string>& command, const std::function<void(cpp_redis::reply&)>& callback, bool readOnly, std::set<cpp_redis::client*>& pending);
+replica* pickReplica(connection* conn);
+std::function<void(size_t, cpp_redis::reply&)> gatherArray(size_t count, std::function<void(cpp_redis::reply&)> callback);
+std::function<void(cpp_redis::reply&)> gatherReplies(size_t count, std::function<void(cpp_redis::reply&)> callback);
+void sendToNode(int client_id, cpp_redis::client* node, const std::vector<std::string>& command, const std::function<void(cpp_redis::reply&)>& callback, int redirects);
+void redirect(int client_id, std::vector<std::string> command, std::function<void(cpp_redis::reply&)> callback, int redirects, bool ask, int slot, std::string addr);
+cpp_redis::client* nodeClient(connection* conn, const std::string& addr);
+int loadSlots(connection* conn, std::string host);
+void refreshSlots(int client_id, std::string host, std::function<void()> then);
+int applySlots(connection* conn, std::string host, cpp_redis::reply& r);
+std::string commandKey(const std::vector<std::string>& command);
+int keySlot(const std::string& key);
+
+bool isClient(int client_id);
 int clientDataFromID(int client_id, clientData& client);
 void amx_tick();
+void pushMessage(message m);
+void pushMessage(message m, const std::string& payload);
+void recyclePayload(std::string& payload);
+void statQueued(int client_id, bool superseded);
+void statTaken(const message& m, bool delivered);
+void checkQueueAlerts();
+void addQueueStats(int client_id);
+void dropQueueStats(int client_id);
+int GetQueueStats(int client_id, queueStats& stats, long long& filtered);
+int ResetQueueStats(int client_id);
+int SetQueueAlert(int depth, int latency);
+void takeConflated(message& m);
+void takeBatch(message& first, std::deque<message>& queue);
+void dispatchBatch(const message& first);
+void dispatchMessage(message& m);
+int SetDispatchBudget(int usec);
+void amxLoad(AMX* amx);
+void amxUnload(AMX* amx);
+unsigned int amxGeneration(AMX* amx);
+bool amxAlive(AMX* amx, unsigned int generation);
 std::vector<std::string> split(const std::string s);
+std::string formatNumber(long long value);
+std::string formatNumber(int value);
+std::string formatNumber(float value);
+std::string formatNumber(double value, int precision = 17);
+bool parseNumber(const std::string& str, int& value);
+bool parseNumber(const std::string& str, float& value);
+std::string packCells(const std::vector<int>& data);
+bool unpackCells(const std::string& raw, std::vector<int>& data);
 
 extern int context_count;
 extern std::map<int, clientData> clients;
 extern std::map<std::string, std::string> subscriptions;
-extern std::stack<Impl::message> message_stack;
-extern std::mutex message_stack_mutex;
+extern int iterator_count;
+extern std::map<int, scanIterator> iterators;
+extern std::vector<streamConsumer*> stopped_consumers;
+extern std::deque<Impl::message> message_queues[MESSAGE_PRIORITIES];
+extern std::mutex message_mutex;
+extern std::map<std::pair<int, std::string>, std::string> conflated_messages;
+extern std::vector<std::string> payload_pool;
+extern std::map<int, queueStats> queue_stats;
+extern queueStats total_stats;
+extern std::mutex stats_mutex;
+extern long long tick_latency;
+extern int alert_depth;
+extern int alert_latency;
+extern bool depth_alerted;
+extern bool latency_alerted;
+extern int dispatch_budget;
+extern messageBatch active_batch;
+extern int batch_count;
+extern std::map<AMX*, unsigned int> amx_generations;
+extern unsigned int amx_generation_count;
+
+// owned by the I/O worker thread
+extern std::map<int, connection*> connections;
+extern std::thread io_thread;
+extern std::atomic<bool> io_running;
+extern std::deque<ioTask> io_queue;
+extern std::mutex io_mutex;
+extern std::condition_variable io_cv;
+extern std::deque<std::function<void()>> completions;
+extern std::mutex completions_mutex;
+extern std::map<std::string, std::vector<std::function<void(cpp_redis::reply&)>>> inflight;
+extern std::mutex inflight_mutex;
+extern std::atomic<unsigned int> write_epoch;
+extern std::vector<ioTask> publish_buffer;
+extern std::map<int, shardSubscription*> shards;
+extern std::map<int, std::chrono::steady_clock::time_point> shard_retries;
+extern std::mutex shard_mutex;
+
+extern int lock_count;
+extern std::map<int, distLock*> locks;
+extern std::vector<lockRequest*> lock_requests;
+extern std::mutex locks_mutex;
+extern std::condition_variable lock_cv;
+extern std::thread lock_thread;
+extern std::atomic<bool> lock_running;
 }
 
 #endif
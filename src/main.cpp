@@ -50,28 +50,84 @@ set<AMX*> amx_list;
 extern "C" const AMX_NATIVE_INFO native_list[] = {
     { "Redis_Connect", Natives::Connect },
     { "Redis_Disconnect", Natives::Disconnect },
+    { "Redis_ConnectCluster", Natives::ConnectCluster },
+    { "Redis_ConnectSentinel", Natives::ConnectSentinel },
+    { "Redis_AddReplica", Natives::AddReplica },
+    { "Redis_SetReadPolicy", Natives::SetReadPolicy },
+    { "Redis_SetCompression", Natives::SetCompression },
+    { "Redis_SetWorkerAffinity", Natives::SetWorkerAffinity },
 
     { "Redis_Command", Natives::Command },
     { "Redis_Exists", Natives::Exists },
     { "Redis_SetString", Natives::SetString },
     { "Redis_GetString", Natives::GetString },
+    { "Redis_GetStringAsync", Natives::GetStringAsync },
     { "Redis_SetInt", Natives::SetInt },
     { "Redis_GetInt", Natives::GetInt },
     { "Redis_SetFloat", Natives::SetFloat },
     { "Redis_GetFloat", Natives::GetFloat },
+    { "Redis_SetArray", Natives::SetArray },
+    { "Redis_GetArray", Natives::GetArray },
 
     { "Redis_SetHString", Natives::SetHString },
     { "Redis_SetHInt", Natives::SetHInt },
     { "Redis_GetHString", Natives::GetHString },
+    { "Redis_GetHStringAsync", Natives::GetHStringAsync },
     { "Redis_HExists", Natives::HExists },
     { "Redis_HDel", Natives::HDel },
     { "Redis_HIncrBy", Natives::HIncrBy },
     { "Redis_HIncrByFloat", Natives::HIncrByFloat },
     { "Redis_GetHInt", Natives::GetHInt },
+    { "Redis_SetHFloat", Natives::SetHFloat },
+    { "Redis_GetHFloat", Natives::GetHFloat },
+    { "Redis_SetHArray", Natives::SetHArray },
+    { "Redis_GetHArray", Natives::GetHArray },
+    { "Redis_SetWriteBehind", Natives::SetWriteBehind },
+    { "Redis_Flush", Natives::Flush },
+
+    { "Redis_ZAdd", Natives::ZAdd },
+    { "Redis_ZIncrBy", Natives::ZIncrBy },
+    { "Redis_ZRem", Natives::ZRem },
+    { "Redis_ZScore", Natives::ZScore },
+    { "Redis_ZRange", Natives::ZRange },
+    { "Redis_ZRevRange", Natives::ZRevRange },
+    { "Redis_ZRankBatch", Natives::ZRankBatch },
 
     { "Redis_Subscribe", Natives::Subscribe },
     { "Redis_Unsubscribe", Natives::Unsubscribe },
+    { "Redis_SubscribeBatch", Natives::SubscribeBatch },
+    { "Redis_SubscribeConflated", Natives::SubscribeConflated },
+    { "Redis_SubscribeKeyspace", Natives::SubscribeKeyspace },
+    { "Redis_SSubscribe", Natives::SSubscribe },
+    { "Redis_BatchNext", Natives::BatchNext },
+    { "Redis_AddFilter", Natives::AddFilter },
+    { "Redis_ClearFilters", Natives::ClearFilters },
+    { "Redis_SetDispatchBudget", Natives::SetDispatchBudget },
+    { "Redis_GetQueueStats", Natives::GetQueueStats },
+    { "Redis_GetQueueLatency", Natives::GetQueueLatency },
+    { "Redis_ResetQueueStats", Natives::ResetQueueStats },
+    { "Redis_SetQueueAlert", Natives::SetQueueAlert },
     { "Redis_Publish", Natives::Publish },
+    { "Redis_PublishAsync", Natives::PublishAsync },
+    { "Redis_PublishMulti", Natives::PublishMulti },
+    { "Redis_SPublish", Natives::SPublish },
+    { "Redis_SPublishAsync", Natives::SPublishAsync },
+
+    { "Redis_XAdd", Natives::XAdd },
+    { "Redis_XConsume", Natives::XConsume },
+    { "Redis_XStop", Natives::XStop },
+
+    { "Redis_ScanBegin", Natives::ScanBegin },
+    { "Redis_HScanBegin", Natives::HScanBegin },
+    { "Redis_SScanBegin", Natives::SScanBegin },
+    { "Redis_ScanNext", Natives::ScanNext },
+    { "Redis_HScanNext", Natives::HScanNext },
+    { "Redis_ScanEnd", Natives::ScanEnd },
+
+    { "Redis_LockAcquire", Natives::LockAcquire },
+    { "Redis_LockAcquireAsync", Natives::LockAcquireAsync },
+    { "Redis_LockRelease", Natives::LockRelease },
+    { "Redis_LockHeld", Natives::LockHeld },
 
     { NULL, NULL }
 };
@@ -85,28 +141,34 @@ PLUGIN_EXPORT bool PLUGIN_CALL Load(void** ppData)
     logprintf("SA:MP Redis - Redis for SA:MP by Southclaws");
     logprintf("\n");
 
+    Impl::ioStart();
+
     return true;
 }
 
 PLUGIN_EXPORT void PLUGIN_CALL Unload()
 {
+    Impl::ioStop();
     logprintf("SA:MP Redis unloaded.");
 }
 
 PLUGIN_EXPORT void PLUGIN_CALL ProcessTick()
 {
+    Impl::io_tick();
     Impl::amx_tick();
 }
 
 PLUGIN_EXPORT int PLUGIN_CALL AmxLoad(AMX* amx)
 {
     amx_list.insert(amx);
+    Impl::amxLoad(amx);
     return amx_Register(amx, native_list, -1);
 }
 
 PLUGIN_EXPORT int PLUGIN_CALL AmxUnload(AMX* amx)
 {
     amx_list.erase(amx);
+    Impl::amxUnload(amx);
     return AMX_ERR_NONE;
 }
 
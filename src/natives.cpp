@@ -45,6 +45,63 @@
 #include "natives.hpp"
 #include "impl.hpp"
 
+/*
+    Note:
+    Reads a trailing parameter that older includes may not pass, the first
+    cell of `params` holds the byte count of the parameters that were pushed.
+*/
+static cell getOptionalParam(cell* params, int index, cell def)
+{
+    if (params[0] / static_cast<cell>(sizeof(cell)) < index) {
+        return def;
+    }
+
+    return params[index];
+}
+
+static string getOptionalString(AMX* amx, cell* params, int index)
+{
+    if (params[0] / static_cast<cell>(sizeof(cell)) < index) {
+        return "";
+    }
+
+    return amx_GetCppString(amx, params[index]);
+}
+
+/*
+    Note:
+    Two dimensional Pawn arrays begin with an indirection table, one cell per
+    row, each holding the byte offset from that cell to the start of the row.
+*/
+static cell* getArrayRow(cell* base, int row)
+{
+    return reinterpret_cast<cell*>(reinterpret_cast<char*>(base + row) + base[row]);
+}
+
+static string getArrayRowString(cell* row)
+{
+    int len = 0;
+    amx_StrLen(row, &len);
+
+    string result(len, '\0');
+    if (len > 0) {
+        amx_GetString(&result[0], row, 0, len + 1);
+    }
+
+    return result;
+}
+
+// copies at most `len` cells into a script array and zeroes the rest
+static void copyArray(AMX* amx, cell param, int len, const vector<int>& data)
+{
+    cell* addr;
+    amx_GetAddr(amx, param, &addr);
+
+    for (int i = 0; i < len; ++i) {
+        addr[i] = i < static_cast<int>(data.size()) ? data[i] : 0;
+    }
+}
+
 cell Natives::Connect(AMX* amx, cell* params)
 {
     string hostname = amx_GetCppString(amx, params[1]);
@@ -54,7 +111,7 @@ cell Natives::Connect(AMX* amx, cell* params)
     amx_GetAddr(amx, params[4], &addr);
 
     try {
-        return Impl::Connect(hostname, port, auth, *addr);
+        return Impl::Connect(hostname, port, auth, *addr, getOptionalString(amx, params, 5));
     }
     catch (cpp_redis::redis_error e) {
         logprintf("ERROR: %s", e.what());
@@ -75,6 +132,70 @@ cell Natives::Disconnect(AMX* amx, cell* params)
     }
 }
 
+cell Natives::ConnectCluster(AMX* amx, cell* params)
+{
+    string hostname = amx_GetCppString(amx, params[1]);
+    int port = params[2];
+    string auth = amx_GetCppString(amx, params[3]);
+    cell* addr;
+    amx_GetAddr(amx, params[4], &addr);
+
+    try {
+        return Impl::ConnectCluster(hostname, port, auth, *addr, getOptionalString(amx, params, 5));
+    }
+    catch (cpp_redis::redis_error e) {
+        logprintf("ERROR: %s", e.what());
+        return 1;
+    }
+}
+
+cell Natives::AddReplica(AMX* amx, cell* params)
+{
+    int context_id = params[1];
+    string host = amx_GetCppString(amx, params[2]);
+    int port = params[3];
+
+    try {
+        return Impl::AddReplica(context_id, host, port);
+    }
+    catch (cpp_redis::redis_error e) {
+        logprintf("ERROR: %s", e.what());
+        return 1;
+    }
+}
+
+cell Natives::SetReadPolicy(AMX* amx, cell* params)
+{
+    return Impl::SetReadPolicy(params[1], params[2]);
+}
+
+cell Natives::SetCompression(AMX* amx, cell* params)
+{
+    return Impl::SetCompression(params[1], params[2]);
+}
+
+cell Natives::ConnectSentinel(AMX* amx, cell* params)
+{
+    string sentinels = amx_GetCppString(amx, params[1]);
+    string name = amx_GetCppString(amx, params[2]);
+    string auth = amx_GetCppString(amx, params[3]);
+    cell* addr;
+    amx_GetAddr(amx, params[4], &addr);
+
+    try {
+        return Impl::ConnectSentinel(sentinels, name, auth, *addr, getOptionalString(amx, params, 5));
+    }
+    catch (cpp_redis::redis_error e) {
+        logprintf("ERROR: %s", e.what());
+        return 1;
+    }
+}
+
+cell Natives::SetWorkerAffinity(AMX* amx, cell* params)
+{
+    return Impl::SetWorkerAffinity(params[1]);
+}
+
 cell Natives::Command(AMX* amx, cell* params)
 {
     int context_id = params[1];
@@ -95,7 +216,7 @@ cell Natives::Exists(AMX* amx, cell* params)
     string key = amx_GetCppString(amx, params[2]);
 
     try {
-        return Impl::Exists(context_id, key);
+        return Impl::Exists(context_id, key, getOptionalParam(params, 3, 0) != 0);
     }
     catch (cpp_redis::redis_error e) {
         logprintf("ERROR: %s", e.what());
@@ -110,7 +231,7 @@ cell Natives::SetString(AMX* amx, cell* params)
     string value = amx_GetCppString(amx, params[3]);
 
     try {
-        return Impl::SetString(context_id, key, value);
+        return Impl::SetString(context_id, key, value, getOptionalParam(params, 4, 0), getOptionalParam(params, 5, 0));
     }
     catch (cpp_redis::redis_error e) {
         logprintf("ERROR: %s", e.what());
@@ -126,7 +247,7 @@ cell Natives::GetString(AMX* amx, cell* params)
     int ret;
 
     try {
-        ret = Impl::GetString(context_id, key, value);
+        ret = Impl::GetString(context_id, key, value, getOptionalParam(params, 5, 0) != 0);
     }
     catch (cpp_redis::redis_error e) {
         logprintf("ERROR: %s", e.what());
@@ -137,6 +258,21 @@ cell Natives::GetString(AMX* amx, cell* params)
     return ret;
 }
 
+cell Natives::GetStringAsync(AMX* amx, cell* params)
+{
+    int context_id = params[1];
+    string key = amx_GetCppString(amx, params[2]);
+    string callback = amx_GetCppString(amx, params[3]);
+
+    try {
+        return Impl::GetStringAsync(amx, context_id, key, callback);
+    }
+    catch (cpp_redis::redis_error e) {
+        logprintf("ERROR: %s", e.what());
+        return 1;
+    }
+}
+
 cell Natives::SetInt(AMX* amx, cell* params)
 {
     int context_id = params[1];
@@ -144,7 +280,7 @@ cell Natives::SetInt(AMX* amx, cell* params)
     int value = params[3];
 
     try {
-        return Impl::SetInt(context_id, key, value);
+        return Impl::SetInt(context_id, key, value, getOptionalParam(params, 4, 0), getOptionalParam(params, 5, 0));
     }
     catch (cpp_redis::redis_error e) {
         logprintf("ERROR: %s", e.what());
@@ -160,7 +296,7 @@ cell Natives::GetInt(AMX* amx, cell* params)
     int ret;
 
     try {
-        ret = Impl::GetInt(context_id, key, value);
+        ret = Impl::GetInt(context_id, key, value, getOptionalParam(params, 4, 0) != 0);
     }
     catch (cpp_redis::redis_error e) {
         logprintf("ERROR: %s", e.what());
@@ -181,7 +317,7 @@ cell Natives::SetFloat(AMX* amx, cell* params)
     float value = *(float*)&params[3]; // weird float conversion
 
     try {
-        return Impl::SetFloat(context_id, key, value);
+        return Impl::SetFloat(context_id, key, value, getOptionalParam(params, 4, 0), getOptionalParam(params, 5, 0));
     }
     catch (cpp_redis::redis_error e) {
         logprintf("ERROR: %s", e.what());
@@ -197,7 +333,7 @@ cell Natives::GetFloat(AMX* amx, cell* params)
     int ret;
 
     try {
-        ret = Impl::GetFloat(context_id, key, value);
+        ret = Impl::GetFloat(context_id, key, value, getOptionalParam(params, 4, 0) != 0);
     }
     catch (cpp_redis::redis_error e) {
         logprintf("ERROR: %s", e.what());
@@ -211,6 +347,44 @@ cell Natives::GetFloat(AMX* amx, cell* params)
     return ret;
 }
 
+cell Natives::SetArray(AMX* amx, cell* params)
+{
+    int context_id = params[1];
+    string key = amx_GetCppString(amx, params[2]);
+
+    cell* addr;
+    amx_GetAddr(amx, params[3], &addr);
+    vector<int> data(addr, addr + std::max<cell>(params[4], 0));
+
+    try {
+        return Impl::SetArray(context_id, key, data, getOptionalParam(params, 5, 0), getOptionalParam(params, 6, 0));
+    }
+    catch (cpp_redis::redis_error e) {
+        logprintf("ERROR: %s", e.what());
+        return 1;
+    }
+}
+
+cell Natives::GetArray(AMX* amx, cell* params)
+{
+    int context_id = params[1];
+    string key = amx_GetCppString(amx, params[2]);
+    vector<int> data;
+    int ret;
+
+    try {
+        ret = Impl::GetArray(context_id, key, data, getOptionalParam(params, 5, 0) != 0);
+    }
+    catch (cpp_redis::redis_error e) {
+        logprintf("ERROR: %s", e.what());
+        return 1;
+    }
+
+    copyArray(amx, params[3], params[4], data);
+
+    return ret;
+}
+
 cell Natives::SetHString(AMX* amx, cell* params)
 {
     int context_id = params[1];
@@ -219,7 +393,7 @@ cell Natives::SetHString(AMX* amx, cell* params)
     string value = amx_GetCppString(amx, params[4]);
 
     try {
-        return Impl::SetHString(context_id, key, field, value);
+        return Impl::SetHString(context_id, key, field, value, getOptionalParam(params, 5, 0));
     }
     catch (cpp_redis::redis_error e) {
         logprintf("ERROR: %s", e.what());
@@ -235,7 +409,7 @@ cell Natives::SetHInt(AMX* amx, cell* params)
     int value = params[4];
     
     try {
-        return Impl::SetHString(context_id, key, field, std::to_string(value));
+        return Impl::SetHInt(context_id, key, field, value, getOptionalParam(params, 5, 0));
     }
     catch (cpp_redis::redis_error e) {
         logprintf("ERROR: %s", e.what());
@@ -252,7 +426,7 @@ cell Natives::GetHString(AMX* amx, cell* params)
 
     int ret;
     try {
-        ret = Impl::GetHString(context_id, key, field, value);
+        ret = Impl::GetHString(context_id, key, field, value, getOptionalParam(params, 6, 0) != 0);
     }
     catch (cpp_redis::redis_error e) {
         logprintf("ERROR: %s", e.what());
@@ -264,23 +438,124 @@ cell Natives::GetHString(AMX* amx, cell* params)
     return ret;
 }
 
+cell Natives::GetHStringAsync(AMX* amx, cell* params)
+{
+    int context_id = params[1];
+    string key = amx_GetCppString(amx, params[2]);
+    string field = amx_GetCppString(amx, params[3]);
+    string callback = amx_GetCppString(amx, params[4]);
+
+    try {
+        return Impl::GetHStringAsync(amx, context_id, key, field, callback);
+    }
+    catch (cpp_redis::redis_error e) {
+        logprintf("ERROR: %s", e.what());
+        return 1;
+    }
+}
+
 cell Natives::GetHInt(AMX* amx, cell* params)
 {
     int context_id = params[1];
     string key = amx_GetCppString(amx, params[2]);
     string field = amx_GetCppString(amx, params[3]);
-    string value;
+    int value = 0;
 
     int ret;
     try {
-        ret = Impl::GetHString(context_id, key, field, value);
+        ret = Impl::GetHInt(context_id, key, field, value, getOptionalParam(params, 4, 0) != 0);
     }
     catch (cpp_redis::redis_error e) {
         logprintf("ERROR: %s", e.what());
-        return 0;
+        ret = 1;
+    }
+
+    if (params[0] >= 5 * static_cast<cell>(sizeof(cell))) {
+        cell* addr;
+        amx_GetAddr(amx, params[5], &addr);
+        *addr = ret;
+    }
+
+    return value;
+}
+
+cell Natives::SetHFloat(AMX* amx, cell* params)
+{
+    int context_id = params[1];
+    string key = amx_GetCppString(amx, params[2]);
+    string field = amx_GetCppString(amx, params[3]);
+    float value = *(float*)&params[4];
+
+    try {
+        return Impl::SetHFloat(context_id, key, field, value, getOptionalParam(params, 5, 0));
+    }
+    catch (cpp_redis::redis_error e) {
+        logprintf("ERROR: %s", e.what());
+        return 1;
+    }
+}
+
+cell Natives::GetHFloat(AMX* amx, cell* params)
+{
+    int context_id = params[1];
+    string key = amx_GetCppString(amx, params[2]);
+    string field = amx_GetCppString(amx, params[3]);
+    float value = 0.0;
+
+    int ret;
+    try {
+        ret = Impl::GetHFloat(context_id, key, field, value, getOptionalParam(params, 5, 0) != 0);
+    }
+    catch (cpp_redis::redis_error e) {
+        logprintf("ERROR: %s", e.what());
+        return 1;
+    }
+
+    cell* addr;
+    amx_GetAddr(amx, params[4], &addr);
+    *addr = amx_ftoc(value);
+
+    return ret;
+}
+
+cell Natives::SetHArray(AMX* amx, cell* params)
+{
+    int context_id = params[1];
+    string key = amx_GetCppString(amx, params[2]);
+    string field = amx_GetCppString(amx, params[3]);
+
+    cell* addr;
+    amx_GetAddr(amx, params[4], &addr);
+    vector<int> data(addr, addr + std::max<cell>(params[5], 0));
+
+    try {
+        return Impl::SetHArray(context_id, key, field, data, getOptionalParam(params, 6, 0));
+    }
+    catch (cpp_redis::redis_error e) {
+        logprintf("ERROR: %s", e.what());
+        return 1;
+    }
+}
+
+cell Natives::GetHArray(AMX* amx, cell* params)
+{
+    int context_id = params[1];
+    string key = amx_GetCppString(amx, params[2]);
+    string field = amx_GetCppString(amx, params[3]);
+    vector<int> data;
+    int ret;
+
+    try {
+        ret = Impl::GetHArray(context_id, key, field, data, getOptionalParam(params, 6, 0) != 0);
+    }
+    catch (cpp_redis::redis_error e) {
+        logprintf("ERROR: %s", e.what());
+        return 1;
     }
 
-    return std::atoi(value.c_str());
+    copyArray(amx, params[4], params[5], data);
+
+    return ret;
 }
 
 cell Natives::HExists(AMX* amx, cell* params)
@@ -290,7 +565,7 @@ cell Natives::HExists(AMX* amx, cell* params)
     string field = amx_GetCppString(amx, params[3]);
 
     try {
-        return Impl::HExists(context_id, key, field);
+        return Impl::HExists(context_id, key, field, getOptionalParam(params, 4, 0) != 0);
     }
     catch (cpp_redis::redis_error e) {
         logprintf("ERROR: %s", e.what());
@@ -345,19 +620,54 @@ cell Natives::HIncrByFloat(AMX* amx, cell* params)
     }
 }
 
+cell Natives::ZAdd(AMX* amx, cell* params)
+{
+    int context_id = params[1];
+    string key = amx_GetCppString(amx, params[2]);
+    string member = amx_GetCppString(amx, params[3]);
+    float score = *(float*)&params[4];
 
-cell Natives::Subscribe(AMX* amx, cell* params)
+    try {
+        return Impl::ZAdd(context_id, key, member, score);
+    }
+    catch (cpp_redis::redis_error e) {
+        logprintf("ERROR: %s", e.what());
+        return 1;
+    }
+}
+
+cell Natives::ZIncrBy(AMX* amx, cell* params)
 {
-    string host = amx_GetCppString(amx, params[1]);
-    int port = params[2];
-    string auth = amx_GetCppString(amx, params[3]);
-    string channel = amx_GetCppString(amx, params[4]);
-    string callback = amx_GetCppString(amx, params[5]);
+    int context_id = params[1];
+    string key = amx_GetCppString(amx, params[2]);
+    string member = amx_GetCppString(amx, params[3]);
+    float incr = *(float*)&params[4];
+    float score = 0.0;
+    int ret;
+
+    try {
+        ret = Impl::ZIncrBy(context_id, key, member, incr, score);
+    }
+    catch (cpp_redis::redis_error e) {
+        logprintf("ERROR: %s", e.what());
+        return 1;
+    }
+
+    cell* address;
+    amx_GetAddr(amx, params[5], &address);
+    *address = amx_ftoc(score);
+
+    return ret;
+}
+
+cell Natives::ZRem(AMX* amx, cell* params)
+{
+    int context_id = params[1];
+    string key = amx_GetCppString(amx, params[2]);
+    string member = amx_GetCppString(amx, params[3]);
 
-	cell* addr;
-	amx_GetAddr(amx, params[6], &addr);
     try {
-        return Impl::Subscribe(amx, host, port, auth, channel, callback, *addr);
+        return Impl::ZRem(context_id, key, member);
     }
     catch (cpp_redis::redis_error e) {
         logprintf("ERROR: %s", e.what());
@@ -365,28 +675,604 @@ cell Natives::Subscribe(AMX* amx, cell* params)
     }
 }
 
-cell Natives::Unsubscribe(AMX* amx, cell* params)
+cell Natives::ZScore(AMX* amx, cell* params)
 {
+    int context_id = params[1];
+    string key = amx_GetCppString(amx, params[2]);
+    string member = amx_GetCppString(amx, params[3]);
+    float score = 0.0;
+    int ret;
+
     try {
-        return Impl::Unsubscribe(params[1]);
+        ret = Impl::ZScore(context_id, key, member, score, getOptionalParam(params, 5, 0) != 0);
     }
     catch (cpp_redis::redis_error e) {
         logprintf("ERROR: %s", e.what());
         return 1;
     }
+
+    cell* address;
+    amx_GetAddr(amx, params[4], &address);
+    *address = amx_ftoc(score);
+
+    return ret;
 }
 
-cell Natives::Publish(AMX* amx, cell* params)
+/*
+    Note:
+    Shared by ZRange and ZRevRange. The members array is a two dimensional
+    Pawn array so each row is located through the indirection table at the
+    start of the array, see `getArrayRow`.
+*/
+static cell zrange(AMX* amx, cell* params, bool reverse)
 {
-    int pubsub_id = params[1];
-    string channel = amx_GetCppString(amx, params[2]);
-    string message = amx_GetCppString(amx, params[3]);
+    int context_id = params[1];
+    string key = amx_GetCppString(amx, params[2]);
+    int start = params[3];
+    int stop = params[4];
+    int max = params[8];
+    int len = params[9];
+    vector<std::pair<string, float>> result;
+    int ret;
 
     try {
-        return Impl::Publish(pubsub_id, channel, message);
+        ret = Impl::ZRange(context_id, key, start, stop, reverse, result, getOptionalParam(params, 10, 0) != 0);
     }
     catch (cpp_redis::redis_error e) {
         logprintf("ERROR: %s", e.what());
         return 1;
     }
+
+    cell* members;
+    cell* scores;
+    cell* count;
+    amx_GetAddr(amx, params[5], &members);
+    amx_GetAddr(amx, params[6], &scores);
+    amx_GetAddr(amx, params[7], &count);
+
+    int n = 0;
+    for (auto& item : result) {
+        if (n >= max) {
+            break;
+        }
+        amx_SetString(getArrayRow(members, n), item.first.c_str(), 0, 0, len);
+        scores[n] = amx_ftoc(item.second);
+        ++n;
+    }
+    *count = n;
+
+    return ret;
+}
+
+cell Natives::ZRange(AMX* amx, cell* params)
+{
+    return zrange(amx, params, false);
+}
+
+cell Natives::ZRevRange(AMX* amx, cell* params)
+{
+    return zrange(amx, params, true);
+}
+
+cell Natives::ZRankBatch(AMX* amx, cell* params)
+{
+    int context_id = params[1];
+    string key = amx_GetCppString(amx, params[2]);
+    int count = params[5];
+    bool reverse = params[6] != 0;
+
+    cell* members;
+    amx_GetAddr(amx, params[3], &members);
+
+    vector<string> names;
+    names.reserve(count);
+    for (int i = 0; i < count; ++i) {
+        names.push_back(getArrayRowString(getArrayRow(members, i)));
+    }
+
+    vector<int> ranks;
+    int ret;
+
+    try {
+        ret = Impl::ZRankBatch(context_id, key, names, reverse, ranks, getOptionalParam(params, 7, 0) != 0);
+    }
+    catch (cpp_redis::redis_error e) {
+        logprintf("ERROR: %s", e.what());
+        return 1;
+    }
+
+    cell* out;
+    amx_GetAddr(amx, params[4], &out);
+    for (int i = 0; i < count && i < static_cast<int>(ranks.size()); ++i) {
+        out[i] = ranks[i];
+    }
+
+    return ret;
+}
+
+cell Natives::Subscribe(AMX* amx, cell* params)
+{
+    string host = amx_GetCppString(amx, params[1]);
+    int port = params[2];
+    string auth = amx_GetCppString(amx, params[3]);
+    string channel = amx_GetCppString(amx, params[4]);
+    string callback = amx_GetCppString(amx, params[5]);
+
+	cell* addr;
+	amx_GetAddr(amx, params[6], &addr);
+    try {
+        Impl::subscribeOptions options;
+        options.priority = getOptionalParam(params, 7, Impl::PRIORITY_NORMAL);
+        return Impl::Subscribe(amx, host, port, auth, channel, callback, *addr, options);
+    }
+    catch (cpp_redis::redis_error e) {
+        logprintf("ERROR: %s", e.what());
+        return 1;
+    }
+}
+
+cell Natives::SubscribeBatch(AMX* amx, cell* params)
+{
+    string host = amx_GetCppString(amx, params[1]);
+    int port = params[2];
+    string auth = amx_GetCppString(amx, params[3]);
+    string channel = amx_GetCppString(amx, params[4]);
+    string callback = amx_GetCppString(amx, params[5]);
+
+    cell* addr;
+    amx_GetAddr(amx, params[6], &addr);
+    try {
+        Impl::subscribeOptions options;
+        options.priority = getOptionalParam(params, 7, Impl::PRIORITY_NORMAL);
+        options.batched = true;
+        return Impl::Subscribe(amx, host, port, auth, channel, callback, *addr, options);
+    }
+    catch (cpp_redis::redis_error e) {
+        logprintf("ERROR: %s", e.what());
+        return 1;
+    }
+}
+
+cell Natives::SubscribeConflated(AMX* amx, cell* params)
+{
+    string host = amx_GetCppString(amx, params[1]);
+    int port = params[2];
+    string auth = amx_GetCppString(amx, params[3]);
+    string channel = amx_GetCppString(amx, params[4]);
+    string callback = amx_GetCppString(amx, params[5]);
+
+    cell* addr;
+    amx_GetAddr(amx, params[6], &addr);
+    try {
+        Impl::subscribeOptions options;
+        options.conflate = true;
+        options.delimiter = getOptionalString(amx, params, 7);
+        options.priority = getOptionalParam(params, 8, Impl::PRIORITY_NORMAL);
+        return Impl::Subscribe(amx, host, port, auth, channel, callback, *addr, options);
+    }
+    catch (cpp_redis::redis_error e) {
+        logprintf("ERROR: %s", e.what());
+        return 1;
+    }
+}
+
+cell Natives::SubscribeKeyspace(AMX* amx, cell* params)
+{
+    string host = amx_GetCppString(amx, params[1]);
+    int port = params[2];
+    string auth = amx_GetCppString(amx, params[3]);
+    string events = amx_GetCppString(amx, params[4]);
+    string prefix = amx_GetCppString(amx, params[5]);
+    string callback = amx_GetCppString(amx, params[6]);
+
+    cell* addr;
+    amx_GetAddr(amx, params[7], &addr);
+    try {
+        Impl::subscribeOptions options;
+        options.priority = getOptionalParam(params, 9, Impl::PRIORITY_NORMAL);
+        return Impl::SubscribeKeyspace(amx, host, port, auth, getOptionalParam(params, 8, 0), events, prefix, callback, *addr, options, getOptionalParam(params, 10, Impl::KEYSPACE_EVENTS));
+    }
+    catch (cpp_redis::redis_error e) {
+        logprintf("ERROR: %s", e.what());
+        return 1;
+    }
+}
+
+cell Natives::SSubscribe(AMX* amx, cell* params)
+{
+    int context_id = params[1];
+    string channel = amx_GetCppString(amx, params[2]);
+    string callback = amx_GetCppString(amx, params[3]);
+
+    cell* addr;
+    amx_GetAddr(amx, params[4], &addr);
+    try {
+        Impl::subscribeOptions options;
+        options.priority = getOptionalParam(params, 5, Impl::PRIORITY_NORMAL);
+        return Impl::SSubscribe(amx, context_id, channel, callback, *addr, options);
+    }
+    catch (cpp_redis::redis_error e) {
+        logprintf("ERROR: %s", e.what());
+        return 1;
+    }
+}
+
+cell Natives::AddFilter(AMX* amx, cell* params)
+{
+    Impl::messageFilter filter;
+    filter.type = params[2];
+    filter.value = amx_GetCppString(amx, params[3]);
+    filter.field = getOptionalParam(params, 4, 0);
+    filter.delimiter = getOptionalString(amx, params, 5);
+
+    if (filter.type == Impl::FILTER_FIELD && filter.delimiter.empty()) {
+        return 1;
+    }
+
+    return Impl::AddFilter(params[1], filter);
+}
+
+cell Natives::ClearFilters(AMX* amx, cell* params)
+{
+    return Impl::ClearFilters(params[1]);
+}
+
+cell Natives::BatchNext(AMX* amx, cell* params)
+{
+    string msg;
+    if (Impl::BatchNext(params[1], msg)) {
+        return 0;
+    }
+
+    amx_SetCppString(amx, params[2], msg, params[3]);
+
+    return 1;
+}
+
+cell Natives::SetDispatchBudget(AMX* amx, cell* params)
+{
+    return Impl::SetDispatchBudget(params[1]);
+}
+
+cell Natives::GetQueueStats(AMX* amx, cell* params)
+{
+    Impl::queueStats stats;
+    long long filtered;
+
+    int ret = Impl::GetQueueStats(params[1], stats, filtered);
+    if (ret) {
+        return ret;
+    }
+
+    cell* addr;
+    long long values[] = { stats.depth, stats.peak, stats.received, stats.dispatched, filtered, stats.conflated, stats.discarded };
+    for (int i = 0; i < 7; ++i) {
+        amx_GetAddr(amx, params[2 + i], &addr);
+        *addr = static_cast<cell>(values[i]);
+    }
+
+    return 0;
+}
+
+cell Natives::GetQueueLatency(AMX* amx, cell* params)
+{
+    Impl::queueStats stats;
+    long long filtered;
+
+    int ret = Impl::GetQueueStats(params[1], stats, filtered);
+    if (ret) {
+        return ret;
+    }
+
+    copyArray(amx, params[2], params[4], vector<int>(stats.latency, stats.latency + Impl::LATENCY_BUCKETS));
+
+    cell* addr;
+    amx_GetAddr(amx, params[3], &addr);
+    *addr = static_cast<cell>(stats.maxLatency);
+
+    return 0;
+}
+
+cell Natives::ResetQueueStats(AMX* amx, cell* params)
+{
+    return Impl::ResetQueueStats(params[1]);
+}
+
+cell Natives::SetQueueAlert(AMX* amx, cell* params)
+{
+    return Impl::SetQueueAlert(params[1], params[2]);
+}
+
+cell Natives::Unsubscribe(AMX* amx, cell* params)
+{
+    try {
+        return Impl::Unsubscribe(params[1]);
+    }
+    catch (cpp_redis::redis_error e) {
+        logprintf("ERROR: %s", e.what());
+        return 1;
+    }
+}
+
+cell Natives::Publish(AMX* amx, cell* params)
+{
+    int pubsub_id = params[1];
+    string channel = amx_GetCppString(amx, params[2]);
+    string message = amx_GetCppString(amx, params[3]);
+
+    try {
+        return Impl::Publish(pubsub_id, channel, message);
+    }
+    catch (cpp_redis::redis_error e) {
+        logprintf("ERROR: %s", e.what());
+        return 1;
+    }
+}
+
+cell Natives::PublishAsync(AMX* amx, cell* params)
+{
+    int context_id = params[1];
+    string channel = amx_GetCppString(amx, params[2]);
+    string message = amx_GetCppString(amx, params[3]);
+
+    return Impl::PublishAsync(context_id, channel, message);
+}
+
+cell Natives::SPublish(AMX* amx, cell* params)
+{
+    int context_id = params[1];
+    string channel = amx_GetCppString(amx, params[2]);
+    string message = amx_GetCppString(amx, params[3]);
+
+    try {
+        return Impl::Publish(context_id, channel, message, true);
+    }
+    catch (cpp_redis::redis_error e) {
+        logprintf("ERROR: %s", e.what());
+        return 1;
+    }
+}
+
+cell Natives::SPublishAsync(AMX* amx, cell* params)
+{
+    int context_id = params[1];
+    string channel = amx_GetCppString(amx, params[2]);
+    string message = amx_GetCppString(amx, params[3]);
+
+    return Impl::PublishAsync(context_id, channel, message, true);
+}
+
+cell Natives::PublishMulti(AMX* amx, cell* params)
+{
+    int context_id = params[1];
+    string message = amx_GetCppString(amx, params[3]);
+    int count = params[4];
+
+    cell* channels;
+    amx_GetAddr(amx, params[2], &channels);
+
+    vector<string> names;
+    names.reserve(count);
+    for (int i = 0; i < count; ++i) {
+        names.push_back(getArrayRowString(getArrayRow(channels, i)));
+    }
+
+    return Impl::PublishMulti(context_id, names, message);
+}
+
+cell Natives::XAdd(AMX* amx, cell* params)
+{
+    int context_id = params[1];
+    string stream = amx_GetCppString(amx, params[2]);
+    string data = amx_GetCppString(amx, params[3]);
+    int maxlen = params[4];
+    string id;
+    int ret;
+
+    try {
+        ret = Impl::XAdd(context_id, stream, data, maxlen, id);
+    }
+    catch (cpp_redis::redis_error e) {
+        logprintf("ERROR: %s", e.what());
+        return 1;
+    }
+
+    amx_SetCppString(amx, params[5], id, params[6]);
+
+    return ret;
+}
+
+cell Natives::XConsume(AMX* amx, cell* params)
+{
+    string host = amx_GetCppString(amx, params[1]);
+    int port = params[2];
+    string auth = amx_GetCppString(amx, params[3]);
+    string stream = amx_GetCppString(amx, params[4]);
+    string group = amx_GetCppString(amx, params[5]);
+    string consumer = amx_GetCppString(amx, params[6]);
+    string callback = amx_GetCppString(amx, params[7]);
+    int batch = params[9];
+
+    cell* addr;
+    amx_GetAddr(amx, params[8], &addr);
+    try {
+        return Impl::XConsume(amx, host, port, auth, stream, group, consumer, callback, batch, *addr);
+    }
+    catch (cpp_redis::redis_error e) {
+        logprintf("ERROR: %s", e.what());
+        return 1;
+    }
+}
+
+cell Natives::XStop(AMX* amx, cell* params)
+{
+    try {
+        return Impl::XStop(params[1]);
+    }
+    catch (cpp_redis::redis_error e) {
+        logprintf("ERROR: %s", e.what());
+        return 1;
+    }
+}
+
+cell Natives::ScanBegin(AMX* amx, cell* params)
+{
+    int context_id = params[1];
+    string pattern = amx_GetCppString(amx, params[2]);
+    int count = params[3];
+
+    cell* addr;
+    amx_GetAddr(amx, params[4], &addr);
+    try {
+        return Impl::ScanBegin(context_id, "SCAN", "", pattern, count, *addr);
+    }
+    catch (cpp_redis::redis_error e) {
+        logprintf("ERROR: %s", e.what());
+        return 1;
+    }
+}
+
+cell Natives::HScanBegin(AMX* amx, cell* params)
+{
+    int context_id = params[1];
+    string key = amx_GetCppString(amx, params[2]);
+    string pattern = amx_GetCppString(amx, params[3]);
+    int count = params[4];
+
+    cell* addr;
+    amx_GetAddr(amx, params[5], &addr);
+    try {
+        return Impl::ScanBegin(context_id, "HSCAN", key, pattern, count, *addr);
+    }
+    catch (cpp_redis::redis_error e) {
+        logprintf("ERROR: %s", e.what());
+        return 1;
+    }
+}
+
+cell Natives::SScanBegin(AMX* amx, cell* params)
+{
+    int context_id = params[1];
+    string key = amx_GetCppString(amx, params[2]);
+    string pattern = amx_GetCppString(amx, params[3]);
+    int count = params[4];
+
+    cell* addr;
+    amx_GetAddr(amx, params[5], &addr);
+    try {
+        return Impl::ScanBegin(context_id, "SSCAN", key, pattern, count, *addr);
+    }
+    catch (cpp_redis::redis_error e) {
+        logprintf("ERROR: %s", e.what());
+        return 1;
+    }
+}
+
+cell Natives::ScanNext(AMX* amx, cell* params)
+{
+    int iter_id = params[1];
+    string item;
+    string value;
+    int ret;
+
+    try {
+        ret = Impl::ScanNext(iter_id, item, value);
+    }
+    catch (cpp_redis::redis_error e) {
+        logprintf("ERROR: %s", e.what());
+        return 1;
+    }
+
+    amx_SetCppString(amx, params[2], item, params[3]);
+
+    return ret;
+}
+
+cell Natives::HScanNext(AMX* amx, cell* params)
+{
+    int iter_id = params[1];
+    string field;
+    string value;
+    int ret;
+
+    try {
+        ret = Impl::ScanNext(iter_id, field, value);
+    }
+    catch (cpp_redis::redis_error e) {
+        logprintf("ERROR: %s", e.what());
+        return 1;
+    }
+
+    amx_SetCppString(amx, params[2], field, params[4]);
+    amx_SetCppString(amx, params[3], value, params[5]);
+
+    return ret;
+}
+
+cell Natives::ScanEnd(AMX* amx, cell* params)
+{
+    return Impl::ScanEnd(params[1]);
+}
+
+cell Natives::SetWriteBehind(AMX* amx, cell* params)
+{
+    int context_id = params[1];
+    int interval = params[2];
+
+    try {
+        return Impl::SetWriteBehind(context_id, interval);
+    }
+    catch (cpp_redis::redis_error e) {
+        logprintf("ERROR: %s", e.what());
+        return 1;
+    }
+}
+
+cell Natives::Flush(AMX* amx, cell* params)
+{
+    try {
+        return Impl::Flush(params[1]);
+    }
+    catch (cpp_redis::redis_error e) {
+        logprintf("ERROR: %s", e.what());
+        return 1;
+    }
+}
+
+cell Natives::LockAcquire(AMX* amx, cell* params)
+{
+    int context_id = params[1];
+    string name = amx_GetCppString(amx, params[2]);
+    int lease = params[3];
+    cell* addr;
+    amx_GetAddr(amx, params[4], &addr);
+
+    try {
+        return Impl::LockAcquire(amx, context_id, name, lease, *addr);
+    }
+    catch (cpp_redis::redis_error e) {
+        logprintf("ERROR: %s", e.what());
+        return 1;
+    }
+}
+
+cell Natives::LockAcquireAsync(AMX* amx, cell* params)
+{
+    int context_id = params[1];
+    string name = amx_GetCppString(amx, params[2]);
+    int lease = params[3];
+    int timeout = params[4];
+    string callback = amx_GetCppString(amx, params[5]);
+
+    return Impl::LockAcquireAsync(amx, context_id, name, lease, timeout, callback);
+}
+
+cell Natives::LockRelease(AMX* amx, cell* params)
+{
+    return Impl::LockRelease(params[1]);
+}
+
+cell Natives::LockHeld(AMX* amx, cell* params)
+{
+    return Impl::LockHeld(params[1]);
 }
@@ -48,28 +48,84 @@ namespace Natives {
 
 cell Connect(AMX* amx, cell* params);
 cell Disconnect(AMX* amx, cell* params);
+cell ConnectCluster(AMX* amx, cell* params);
+cell ConnectSentinel(AMX* amx, cell* params);
+cell AddReplica(AMX* amx, cell* params);
+cell SetReadPolicy(AMX* amx, cell* params);
+cell SetCompression(AMX* amx, cell* params);
+cell SetWorkerAffinity(AMX* amx, cell* params);
 
 cell Command(AMX* amx, cell* params);
 cell Exists(AMX* amx, cell* params);
 cell SetString(AMX* amx, cell* params);
 cell GetString(AMX* amx, cell* params);
+cell GetStringAsync(AMX* amx, cell* params);
 cell SetInt(AMX* amx, cell* params);
 cell GetInt(AMX* amx, cell* params);
 cell SetFloat(AMX* amx, cell* params);
 cell GetFloat(AMX* amx, cell* params);
+cell SetArray(AMX* amx, cell* params);
+cell GetArray(AMX* amx, cell* params);
 
 cell SetHString(AMX* amx, cell* params);
 cell SetHInt(AMX* amx, cell* params);
 cell GetHString(AMX* amx, cell* params);
+cell GetHStringAsync(AMX* amx, cell* params);
 cell GetHInt(AMX* amx, cell* params);
+cell SetHFloat(AMX* amx, cell* params);
+cell GetHFloat(AMX* amx, cell* params);
+cell SetHArray(AMX* amx, cell* params);
+cell GetHArray(AMX* amx, cell* params);
 cell HExists(AMX* amx, cell* params);
 cell HIncrBy(AMX* amx, cell* params);
 cell HIncrByFloat(AMX* amx, cell* params);
 cell HDel(AMX* amx, cell* params);
+cell SetWriteBehind(AMX* amx, cell* params);
+cell Flush(AMX* amx, cell* params);
+
+cell ZAdd(AMX* amx, cell* params);
+cell ZIncrBy(AMX* amx, cell* params);
+cell ZRem(AMX* amx, cell* params);
+cell ZScore(AMX* amx, cell* params);
+cell ZRange(AMX* amx, cell* params);
+cell ZRevRange(AMX* amx, cell* params);
+cell ZRankBatch(AMX* amx, cell* params);
 
 cell Subscribe(AMX* amx, cell* params);
 cell Unsubscribe(AMX* amx, cell* params);
+cell SubscribeBatch(AMX* amx, cell* params);
+cell SubscribeConflated(AMX* amx, cell* params);
+cell SubscribeKeyspace(AMX* amx, cell* params);
+cell SSubscribe(AMX* amx, cell* params);
+cell BatchNext(AMX* amx, cell* params);
+cell AddFilter(AMX* amx, cell* params);
+cell ClearFilters(AMX* amx, cell* params);
+cell SetDispatchBudget(AMX* amx, cell* params);
+cell GetQueueStats(AMX* amx, cell* params);
+cell GetQueueLatency(AMX* amx, cell* params);
+cell ResetQueueStats(AMX* amx, cell* params);
+cell SetQueueAlert(AMX* amx, cell* params);
 cell Publish(AMX* amx, cell* params);
+cell PublishAsync(AMX* amx, cell* params);
+cell PublishMulti(AMX* amx, cell* params);
+cell SPublish(AMX* amx, cell* params);
+cell SPublishAsync(AMX* amx, cell* params);
+
+cell XAdd(AMX* amx, cell* params);
+cell XConsume(AMX* amx, cell* params);
+cell XStop(AMX* amx, cell* params);
+
+cell ScanBegin(AMX* amx, cell* params);
+cell HScanBegin(AMX* amx, cell* params);
+cell SScanBegin(AMX* amx, cell* params);
+cell ScanNext(AMX* amx, cell* params);
+cell HScanNext(AMX* amx, cell* params);
+cell ScanEnd(AMX* amx, cell* params);
+
+cell LockAcquire(AMX* amx, cell* params);
+cell LockAcquireAsync(AMX* amx, cell* params);
+cell LockRelease(AMX* amx, cell* params);
+cell LockHeld(AMX* amx, cell* params);
 };
 
 #endif